@@ -1,161 +1,346 @@
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <ctime>
+#include <fstream>
+#include <mutex>
+#include <numbers>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "tgaimage.h"
 #include "geometry.h"
 #include "model.h"
 #include "texture.h"
 #include "render.h"
+#include "daemon.h"
+#include "texturecache.h"
+#include "framesink.h"
+#include "shaders.h"
 
 const int width = 800;
 const int height = 800;
 
-Model *model = nullptr;
-Vec3f light_dir(1, 1, 1);
-
 const Vec3f cameraPos(1, 0.8, 3);
 const Vec3f cameraCenter(0, 0, 0);
 const Vec3f cameraUp(0, 1, 0);
 
 int cnt = 0;
-struct Shader : public IShader
+
+// 一帧的相机和光照, 都在世界空间中
+struct View
 {
-    mat<2, 3, float> varying_uv;
-    mat<4, 3, float> varying_tri;
-    mat<3, 3, float> varying_nrm;
-    mat<3, 3, float> ndc_tri;
+    Vec3f eye;
+    Vec3f center = cameraCenter;
+    Vec3f light = Vec3f(1, 1, 1);
+};
 
-    virtual Vec4f vertex(int iface, int nthvert)
+// 绕过 cameraCenter 的竖直轴转一周的 n 个视角, 第一个就是 cameraPos
+std::vector<View> orbitViews(int n)
+{
+    std::vector<View> views(n);
+    Vec3f d = cameraPos - cameraCenter;
+    for (int f = 0; f < n; f++)
     {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        varying_nrm.set_col(nthvert, proj<3>((Projection * ModelView).invert_transpose() * embed<4>(model->normal(iface, nthvert), 0.f)));
-        Vec4f gl_Vertex = Projection * ModelView * embed<4>(model->vert(iface, nthvert));
-        varying_tri.set_col(nthvert, gl_Vertex);
-        ndc_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
+        float angle = 2 * std::numbers::pi_v<float> * f / n;
+        float c = std::cos(angle), s = std::sin(angle);
+        views[f].eye = cameraCenter + Vec3f(d.x * c + d.z * s, d.y, d.z * c - d.x * s);
     }
+    return views;
+}
 
-    virtual bool fragment(Vec3f bar, TGAColor &color)
+// 视角列表文件, 每行一帧: "eye.x eye.y eye.z [center.x center.y center.z [light.x light.y light.z]]",
+// 空行和 # 开头的行忽略
+bool loadViews(const std::string &path, std::vector<View> &views)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
     {
-
-        float ka = 0.1, kd = 0.9, ks = 0.3, p = 60;
-        TGAColor amb = {128, 128, 128, 255};
-
-        Vec3f bn = (varying_nrm * bar).normalize();
-        Vec2f uv = varying_uv * bar;
-        Vec3f vtx = ndc_tri * bar;
-        mat<3, 3, float> A;
-        A[0] = ndc_tri.col(1) - ndc_tri.col(0);
-        A[1] = ndc_tri.col(2) - ndc_tri.col(0);
-        A[2] = bn;
-
-        mat<3, 3, float> AI = A.invert();
-
-        Vec3f i = AI * Vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-        Vec3f j = AI * Vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-
-        mat<3, 3, float> B;
-        B.set_col(0, i.normalize());
-        B.set_col(1, j.normalize());
-        B.set_col(2, bn);
-        Vec3f n = (B * model->normal(uv)).normalize();
-
-        float diff = std::max(0.f, n * light_dir);
-
-        // 计算高光
-        Vec3f eyeDir = -vtx;
-        Vec3f half = (light_dir + eyeDir).normalize();
-        float spec = std::max(0.f, half * bn);
-
-        color = amb * ka + model->diff(uv) * diff * kd + model->spec(uv) * std::pow(spec, p) * ks;
-
+        std::cerr << "can't open view list " << path << std::endl;
         return false;
     }
-};
-struct PhongShader : public IShader
-{
-    mat<3, 3, float> varying_nrm;
-    mat<2, 3, float> varying_uv;
-    mat<3, 3, float> ndc_tri;
-    mat<4, 3, float> varying_tri;
-    virtual Vec4f vertex(int iface, int nthvert)
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++)
     {
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Projection * ModelView * gl_Vertex;
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        varying_nrm.set_col(nthvert, proj<3>((Projection * ModelView).invert_transpose() * embed<4>(model->normal(iface, nthvert), 0.f)));
-        ndc_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        varying_tri.set_col(nthvert, gl_Vertex);
-        return gl_Vertex;
+        std::istringstream ss(line);
+        View v;
+        if (!(ss >> std::ws) || ss.peek() == '#' || ss.peek() == EOF)
+            continue;
+        if (!(ss >> v.eye.x >> v.eye.y >> v.eye.z))
+        {
+            std::cerr << path << ":" << n << ": bad view" << std::endl;
+            return false;
+        }
+        if (ss >> v.center.x >> v.center.y >> v.center.z)
+            ss >> v.light.x >> v.light.y >> v.light.z;
+        views.push_back(v);
     }
+    return true;
+}
 
-    virtual bool fragment(Vec3f bar, TGAColor &color)
-    {
-
-        Vec3f normal = varying_nrm * bar;
-        Vec2f uv = varying_uv * bar;
-
-        mat<3, 3, float> A;
-        A[0] = ndc_tri.col(1) - ndc_tri.col(0);
-        A[1] = ndc_tri.col(2) - ndc_tri.col(0);
-        A[2] = normal;
-
-        mat<3, 3, float> AI = A.invert();
-
-        Vec3f i = AI * Vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-        Vec3f j = AI * Vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-
-        mat<3, 3, float> B;
-        B.set_col(0, i.normalize());
-        B.set_col(1, j.normalize());
-        B.set_col(2, normal);
-
-        Vec3f n = (B * model->normal(uv)).normalize();
-        float intensity = n * light_dir;
-
-        color = model->diff(uv) * intensity;
-        return false;
-    }
-};
+void setCamera(RenderContext &context, const View &view)
+{
+    context.getProjection(-2, -20, 20, 1);
+    context.getView(view.eye, view.center, cameraUp);
+    context.light = view.light;
+}
 int main(int argc, char **argv)
 {
     std::vector<Model *> models;
-    if (argc > 1)
+    bool deferred = false;
+    bool optimize = false;
+    bool clusters = true;
+    float lodThreshold = 1.f;
+    int bench = 0;
+    int frames = 1;
+    int jobs = 1;
+    std::string viewList;
+    std::string output = "TBN.tga";
+    int format = -1;
+    bool daemon = false;
+    DaemonOptions daemonOptions;
+    std::string file;
+    for (int i = 1; i < argc; i++)
     {
-        std::string file;
-        for (int i = 1; i < argc; i++)
+        file = argv[i];
+        // -deferred: 先写 G-buffer, 再对每个可见像素着色一次
+        if (file == "-deferred")
+        {
+            deferred = true;
+            continue;
+        }
+        // -optimize: 加载按顶点缓存和过度绘制重排过的网格, 对之后的模型生效
+        if (file == "-optimize")
+        {
+            optimize = true;
+            continue;
+        }
+        // -noclusters: 不按 meshlet 整簇剔除, 所有顶点和三角形都进入管线
+        if (file == "-noclusters")
+        {
+            clusters = false;
+            continue;
+        }
+        // -lod pixels: LOD 误差投影到屏幕上允许的像素数, 0 总是用原网格
+        if (file == "-lod" && i + 1 < argc)
+        {
+            lodThreshold = std::atof(argv[++i]);
+            continue;
+        }
+        // -filter nearest|bilinear|trilinear|aniso: 纹理过滤方式, 默认三线性
+        if (file == "-filter" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if (name == "nearest")
+                Texture::setFilter(NEAREST);
+            else if (name == "bilinear")
+                Texture::setFilter(BILINEAR);
+            else if (name == "trilinear")
+                Texture::setFilter(TRILINEAR);
+            else if (name == "aniso")
+                Texture::setFilter(ANISOTROPIC);
+            else
+                std::cerr << "unknown filter " << name << std::endl;
+            continue;
+        }
+        // -frames N: 相机绕模型转一周渲染 N 帧, 写出与下一帧的渲染并行
+        if (file == "-frames" && i + 1 < argc)
+        {
+            frames = std::max(1, std::atoi(argv[++i]));
+            continue;
+        }
+        // -views file: 按视角列表逐行渲染, 代替 -frames 的环绕
+        if (file == "-views" && i + 1 < argc)
+        {
+            viewList = argv[++i];
+            continue;
+        }
+        // -jobs N: 同时渲染 N 帧, 每帧占用 1/N 的核
+        if (file == "-jobs" && i + 1 < argc)
+        {
+            jobs = std::max(1, std::atoi(argv[++i]));
+            continue;
+        }
+        // -o target: 输出位置, "-" 为标准输出, 含 %d 时按帧编号
+        if (file == "-o" && i + 1 < argc)
+        {
+            output = argv[++i];
+            continue;
+        }
+        // -format raw|ppm|qoi|tga: 输出格式, 默认按扩展名推断
+        if (file == "-format" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            const char *names[] = {"raw", "ppm", "qoi", "tga"};
+            for (int f = 0; f < 4; f++)
+                if (name == names[f])
+                    format = f;
+            if (format < 0)
+                std::cerr << "unknown format " << name << std::endl;
+            continue;
+        }
+        // -bench N: 分别用虚函数路径和特化路径渲染 N 帧, 比较每帧耗时
+        if (file == "-bench" && i + 1 < argc)
+        {
+            bench = std::atoi(argv[++i]);
+            continue;
+        }
+        // -daemon: 常驻渲染服务, 从标准输入或 -socket 指定的 Unix 套接字逐行读请求
+        if (file == "-daemon")
+        {
+            daemon = true;
+            continue;
+        }
+        if (file == "-socket" && i + 1 < argc)
+        {
+            daemonOptions.socketPath = argv[++i];
+            continue;
+        }
+        // -workers N, -queue N: 服务同时渲染的任务数和排队的上限
+        if (file == "-workers" && i + 1 < argc)
         {
-            file = argv[i];
-            model = new Model(("../" + file).c_str());
-            models.push_back(model);
+            daemonOptions.workers = std::max(0, std::atoi(argv[++i]));
+            continue;
         }
+        if (file == "-queue" && i + 1 < argc)
+        {
+            daemonOptions.queueDepth = std::max(1, std::atoi(argv[++i]));
+            continue;
+        }
+        models.push_back(new Model(("../" + file).c_str(), optimize));
     }
-    else
+    if (daemon)
+    {
+        // 请求中的模型路径相对于当前目录
+        daemonOptions.optimize = optimize;
+        return runDaemon(daemonOptions);
+    }
+    if (models.empty())
     {
-        model = new Model("../obj/african_head/african_head");
-        models.push_back(model);
+        models.push_back(new Model("../obj/african_head/african_head", optimize));
     }
 
-    getView(cameraPos, cameraCenter, cameraUp);
-    getProjection(-2, -20, 20, 1);
-    getViewport(width, height);
-    light_dir = proj<3>((Projection * ModelView).invert_transpose() * embed<4>(light_dir, 0.f)).normalize();
+    std::vector<View> views;
+    if (viewList.empty())
+        views = orbitViews(frames);
+    else if (!loadViews(viewList, views) || views.empty())
+        return 1;
+    frames = views.size();
+    jobs = std::min(jobs, frames);
+
     PhongShader shader;
-    Render *render = new Render(width, height, &shader, MSAA::TWO_TWO);
-    for (int t = 0; t < std::max(1, argc - 1); t++)
+    for (int pass = 0; pass < 2 && bench > 0; pass++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < bench; f++)
+        {
+            Render frame(width, height, &shader, MSAA::TWO_TWO);
+            frame.setDeferred(deferred);
+            frame.setClusterCull(clusters);
+            frame.setLodThreshold(lodThreshold);
+            setCamera(frame.getContext(), views[0]);
+            for (int t = 0; t < (int)models.size(); t++)
+                pass ? frame.draw<PhongShader>(models[t]) : frame.draw(models[t]);
+            frame.resolve();
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << (pass ? "specialized: " : "virtual: ") << elapsed.count() / bench << " ms/frame" << std::endl;
+    }
+    FrameSink *sink = FrameSink::create(output, format < 0 ? FrameSink::formatOf(output) : (FrameFormat)format);
+    // 每个任务渲染时占一块缓冲, 再多一块给写出线程
+    AsyncFrameWriter *writer = new AsyncFrameWriter(sink, width, height, TGAImage::RGB, jobs + 1);
+    std::mutex dispatch;
+    int next = 0;
+    std::vector<CullStats> cullStats(jobs);
+    std::vector<double> renderMs(jobs, 0);
+    // 每个任务用自己的 Render 依次渲染分到的帧, 帧缓冲和采样缓冲在帧之间复用
+    auto worker = [&](int job)
     {
-        model = models[t];
-        for (int i = 0; i < model->nfaces(); i++)
+#ifdef _OPENMP
+        if (jobs > 1)
+            omp_set_num_threads(std::max(1, omp_get_num_procs() / jobs));
+#endif
+        Render render(width, height, &shader, MSAA::TWO_TWO);
+        render.setDeferred(deferred);
+        render.setClusterCull(clusters);
+        render.setLodThreshold(lodThreshold);
+        for (int n = 0;; n++)
         {
-            for (int j = 0; j < 3; j++)
+            int f;
+            TGAImage *image;
             {
-                shader.vertex(i, j);
+                // 按帧号顺序取缓冲, 写出顺序与帧号一致; 前面的帧不会因为后面的帧占满缓冲而等待
+                std::lock_guard<std::mutex> guard(dispatch);
+                if (next >= frames)
+                    break;
+                f = next++;
+                image = writer->acquire();
             }
-            render->triangle(shader.varying_tri);
+            auto frameStart = std::chrono::steady_clock::now();
+            if (n > 0)
+                render.clear();
+            setCamera(render.getContext(), views[f]);
+            for (int t = 0; t < (int)models.size(); t++)
+                render.draw<PhongShader>(models[t]);
+            render.resolve(image);
+            writer->submit(image, f);
+            renderMs[job] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
         }
+        cullStats[job] = render.getCullStats();
+    };
+    auto start = std::chrono::steady_clock::now();
+    if (jobs == 1)
+    {
+        worker(0);
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (int j = 0; j < jobs; j++)
+            threads.emplace_back(worker, j);
+        for (std::thread &t : threads)
+            t.join();
+    }
+    writer->finish();
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - start;
+    CullStats cull = {};
+    double totalRenderMs = 0;
+    for (int j = 0; j < jobs; j++)
+    {
+        cull.triangles += cullStats[j].triangles, cull.tiles += cullStats[j].tiles, cull.blocks += cullStats[j].blocks;
+        cull.backfaces += cullStats[j].backfaces, cull.degenerate += cullStats[j].degenerate;
+        cull.frustum += cullStats[j].frustum, cull.clipped += cullStats[j].clipped;
+        cull.clusters += cullStats[j].clusters, cull.clusterFrustum += cullStats[j].clusterFrustum;
+        cull.clusterBackfaces += cullStats[j].clusterBackfaces, cull.clusterOccluded += cullStats[j].clusterOccluded;
+        cull.clusterTriangles += cullStats[j].clusterTriangles, cull.lodTriangles += cullStats[j].lodTriangles;
+        totalRenderMs += renderMs[j];
+    }
+    std::cerr << "culled: backfaces " << cull.backfaces << " degenerate " << cull.degenerate << " frustum " << cull.frustum << " clipped " << cull.clipped << std::endl;
+    std::cerr << "lod: " << cull.lodTriangles / (double)frames << " fewer triangles per frame" << std::endl;
+    if (clusters)
+    {
+        // 每帧平均: 整簇剔除的 meshlet 数和其中的三角形数
+        long long faces = 0;
+        for (Model *m : models)
+            faces += m->nfaces();
+        std::cerr << "clusters culled per frame: " << (cull.clusterFrustum + cull.clusterBackfaces + cull.clusterOccluded) / (double)frames << " of " << cull.clusters / (double)frames
+                  << " (frustum " << cull.clusterFrustum / (double)frames << " backface " << cull.clusterBackfaces / (double)frames << " occluded " << cull.clusterOccluded / (double)frames
+                  << "), triangles " << cull.clusterTriangles / (double)frames << " of " << faces << std::endl;
     }
-    render->getImage()->flip_vertically();
-    render->getImage()->write_tga_file("TBN.tga");
+    std::cerr << "hi-z culled: triangles " << cull.triangles << " tiles " << cull.tiles << " blocks " << cull.blocks << std::endl;
+    TextureCacheStats tex = TextureCache::instance().getStats();
+    std::cerr << "textures: hits " << tex.hits << " misses " << tex.misses << " evictions " << tex.evictions << " resident " << (tex.residentBytes >> 20) << "MB in " << tex.entries << std::endl;
+    FrameSinkStats out = sink->getStats();
+    std::cerr << "output: " << out.frames << " frames, encode " << out.encodeMs / std::max(1, out.frames) << " ms/frame, " << (out.bytes >> 10) << "KB" << std::endl;
+    // stalled 是等待空闲缓冲的时间, 写出跟不上时增大
+    std::cerr << "frames: " << frames << " in " << wall.count() << " ms (" << frames * 1000 / wall.count() << " fps, " << jobs << " jobs), render " << totalRenderMs / frames << " ms/frame, stalled " << writer->getWaitMs() << " ms" << std::endl;
+    delete writer;
+    delete sink;
     while (models.size())
     {
         delete models.back();
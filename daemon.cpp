@@ -0,0 +1,606 @@
+#include "daemon.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "framesink.h"
+#include "json.h"
+#include "render.h"
+#include "shaders.h"
+#include "texturecache.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define DAEMON_SOCKETS
+#endif
+
+namespace
+{
+double nowMs()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 一个客户端连接. 回复由不同的工作线程写出, 整行加锁写出;
+// 读端结束并且所有任务都已回复之后连接才关闭
+struct Connection
+{
+    int fd; // -1 表示标准输出
+    std::mutex lock;
+    std::condition_variable idle;
+    int pending = 0; // 已接收还没有回复的任务
+
+    Connection(int fd) : fd(fd) {}
+
+    void send(const std::string &line)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fd < 0)
+        {
+            std::cout << line << std::endl;
+            return;
+        }
+#ifdef DAEMON_SOCKETS
+        std::string data = line + "\n";
+        int flags = 0;
+#ifdef MSG_NOSIGNAL
+        flags = MSG_NOSIGNAL; // 客户端提前断开时不要因为 SIGPIPE 退出
+#endif
+        for (size_t sent = 0; sent < data.size();)
+        {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, flags);
+            if (n <= 0)
+                return;
+            sent += n;
+        }
+#endif
+    }
+    void begin()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending++;
+    }
+    void end()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (--pending == 0)
+            idle.notify_all();
+    }
+    void drain()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+};
+
+struct Job
+{
+    JsonValue request;
+    std::string id;
+    std::shared_ptr<Connection> conn;
+    double received;
+};
+
+struct JobMetrics
+{
+    double queueMs, loadMs, renderMs, encodeMs, totalMs;
+};
+
+struct ModelEntry
+{
+    std::once_flag once;
+    std::shared_ptr<Model> model;
+};
+
+// 工作线程上一次用的 Render, 参数相同的任务直接清空复用
+struct RenderSlot
+{
+    Render *render = nullptr;
+    int width = 0, height = 0;
+    MSAA msaa = MSAA::ONE_ONE;
+    bool specular = false;
+    bool deferred = false;
+};
+
+const int RECENT_JOBS = 1024; // 统计延迟分布时保留的最近任务数
+
+class RenderDaemon
+{
+private:
+    DaemonOptions options;
+    PhongShader phong;
+    Shader specular;
+
+    std::mutex modelLock;
+    std::map<std::string, std::shared_ptr<ModelEntry>> models;
+
+    std::mutex queueLock;
+    std::condition_variable notEmpty, notFull;
+    std::deque<Job> queue;
+    bool stopping;
+    int workerCount;
+    std::vector<std::thread> workers;
+
+    std::mutex metricLock;
+    long long completed, failed;
+    JobMetrics sums;
+    std::vector<double> recent; // 最近任务的总延迟, 环形缓冲
+    size_t recentNext;
+    double started;
+
+    std::shared_ptr<Model> model(const std::string &path, std::string &error);
+    bool render(const Job &job, RenderSlot &slot, JobMetrics &m, std::string &error);
+    void worker();
+    void record(const JobMetrics &m, bool ok);
+    std::string stats();
+
+public:
+    RenderDaemon(const DaemonOptions &options);
+    ~RenderDaemon();
+    // 处理一行请求, 渲染任务进入队列(队列满时阻塞); 返回 false 表示收到了 shutdown
+    bool handle(const std::string &line, const std::shared_ptr<Connection> &conn);
+    bool isStopping();
+    // 处理完队列中的任务, 结束工作线程
+    void stop();
+};
+
+RenderDaemon::RenderDaemon(const DaemonOptions &options) : options(options)
+{
+    stopping = false;
+    completed = failed = 0;
+    sums = {};
+    recentNext = 0;
+    started = nowMs();
+    workerCount = options.workers > 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < workerCount; i++)
+        workers.emplace_back(&RenderDaemon::worker, this);
+    std::cerr << "daemon: " << workerCount << " workers, queue depth " << options.queueDepth << std::endl;
+}
+
+RenderDaemon::~RenderDaemon()
+{
+    stop();
+}
+
+bool RenderDaemon::isStopping()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    return stopping;
+}
+
+void RenderDaemon::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        stopping = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+    workers.clear();
+}
+
+std::shared_ptr<Model> RenderDaemon::model(const std::string &path, std::string &error)
+{
+    std::string key = path + (options.optimize ? "#optimized" : "");
+    std::shared_ptr<ModelEntry> entry;
+    {
+        std::lock_guard<std::mutex> guard(modelLock);
+        std::shared_ptr<ModelEntry> &e = models[key];
+        if (!e)
+            e = std::make_shared<ModelEntry>();
+        entry = e;
+    }
+    // 同一模型只加载一次, 其它要用它的任务等待加载完成; 加载不同模型的任务互不阻塞
+    std::call_once(entry->once, [&] { entry->model = std::make_shared<Model>(path, options.optimize); });
+    if (entry->model->nfaces() == 0)
+    {
+        error = "can't load model " + path;
+        std::lock_guard<std::mutex> guard(modelLock);
+        auto it = models.find(key);
+        if (it != models.end() && it->second == entry)
+            models.erase(it); // 下次请求时重试, 文件可能之后才生成
+        return nullptr;
+    }
+    return entry->model;
+}
+
+static bool vec3(const JsonValue &request, const char *key, Vec3f &v, std::string &error)
+{
+    const JsonValue *a = request.get(key);
+    if (!a)
+        return true;
+    if (a->type != JsonValue::ARRAY || a->array.size() != 3)
+    {
+        error = std::string(key) + " must be an array of 3 numbers";
+        return false;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (a->array[i].type != JsonValue::NUMBER)
+        {
+            error = std::string(key) + " must be an array of 3 numbers";
+            return false;
+        }
+        v[i] = a->array[i].number;
+    }
+    return true;
+}
+
+bool RenderDaemon::render(const Job &job, RenderSlot &slot, JobMetrics &m, std::string &error)
+{
+    const JsonValue &req = job.request;
+    // 参数检查
+    int width = req.getNumber("width", 256), height = req.getNumber("height", 256);
+    if (width < 1 || height < 1 || width > 8192 || height > 8192)
+        return error = "width and height must be in [1, 8192]", false;
+    int samples = req.getNumber("msaa", 4);
+    if (samples != 1 && samples != 4)
+        return error = "msaa must be 1 or 4", false;
+    std::string shaderName = req.getString("shader", "phong");
+    if (shaderName != "phong" && shaderName != "specular")
+        return error = "unknown shader " + shaderName, false;
+    std::string output = req.getString("output", "");
+    if (output.empty() || output == "-")
+        return error = "output must be a file path", false;
+    FrameFormat format = FrameSink::formatOf(output);
+    std::string formatName = req.getString("format", "");
+    const char *formats[] = {"raw", "ppm", "qoi", "tga"};
+    if (!formatName.empty())
+    {
+        int f = 0;
+        while (f < 4 && formatName != formats[f])
+            f++;
+        if (f == 4)
+            return error = "unknown format " + formatName, false;
+        format = (FrameFormat)f;
+    }
+    Vec3f eye(1, 0.8, 3), center(0, 0, 0), light(1, 1, 1), up(0, 1, 0);
+    if (!vec3(req, "eye", eye, error) || !vec3(req, "center", center, error) || !vec3(req, "light", light, error) || !vec3(req, "up", up, error))
+        return false;
+    const JsonValue *list = req.get("models");
+    if (!list || list->type != JsonValue::ARRAY || list->array.empty())
+        return error = "models must be a non-empty array of paths", false;
+
+    // 模型常驻内存, 第一次用到时加载
+    double start = nowMs();
+    std::vector<std::shared_ptr<Model>> drawList;
+    for (const JsonValue &path : list->array)
+    {
+        if (path.type != JsonValue::STRING)
+            return error = "models must be a non-empty array of paths", false;
+        std::shared_ptr<Model> model = this->model(path.string, error);
+        if (!model)
+            return false;
+        drawList.push_back(model);
+    }
+    m.loadMs = nowMs() - start;
+
+    start = nowMs();
+    MSAA msaa = samples == 4 ? MSAA::TWO_TWO : MSAA::ONE_ONE;
+    bool useSpecular = shaderName == "specular";
+    bool deferred = req.getBool("deferred", false);
+    float lodThreshold = req.getNumber("lod", 1);
+    if (slot.render && slot.width == width && slot.height == height && slot.msaa == msaa && slot.specular == useSpecular)
+    {
+        slot.render->clear();
+    }
+    else
+    {
+        delete slot.render;
+        slot.render = new Render(width, height, useSpecular ? (IShader *)&specular : (IShader *)&phong, msaa);
+        slot.width = width, slot.height = height, slot.msaa = msaa, slot.specular = useSpecular;
+        slot.deferred = false;
+    }
+    if (slot.deferred != deferred)
+    {
+        slot.render->setDeferred(deferred);
+        slot.deferred = deferred;
+    }
+    slot.render->setLodThreshold(lodThreshold);
+    RenderContext &context = slot.render->getContext();
+    context.getProjection(-2, -20, 20, (float)height / width);
+    context.getView(eye, center, up);
+    context.light = light;
+    for (const std::shared_ptr<Model> &model : drawList)
+    {
+        if (useSpecular)
+            slot.render->draw<Shader>(model.get());
+        else
+            slot.render->draw<PhongShader>(model.get());
+    }
+    slot.render->resolve();
+    m.renderMs = nowMs() - start;
+
+    start = nowMs();
+    FrameSink *sink = FrameSink::create(output, format);
+    bool ok = sink->write(*slot.render->getImage(), 0);
+    delete sink;
+    m.encodeMs = nowMs() - start;
+    if (!ok)
+        return error = "can't write " + output, false;
+    return true;
+}
+
+void RenderDaemon::worker()
+{
+#ifdef _OPENMP
+    // 多个任务并行时平分核, 避免过度订阅
+    omp_set_num_threads(std::max(1, omp_get_num_procs() / workerCount));
+#endif
+    RenderSlot slot;
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(queueLock);
+            notEmpty.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                break;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        notFull.notify_one();
+        JobMetrics m = {};
+        m.queueMs = nowMs() - job.received;
+        std::string error;
+        bool ok = render(job, slot, m, error);
+        m.totalMs = nowMs() - job.received;
+        record(m, ok);
+        char buf[256];
+        std::string reply = "{\"id\":" + jsonQuote(job.id) + ",\"ok\":" + (ok ? "true" : "false");
+        if (ok)
+        {
+            snprintf(buf, sizeof(buf), ",\"queue_ms\":%.3f,\"load_ms\":%.3f,\"render_ms\":%.3f,\"encode_ms\":%.3f,\"total_ms\":%.3f}",
+                     m.queueMs, m.loadMs, m.renderMs, m.encodeMs, m.totalMs);
+            reply += buf;
+        }
+        else
+        {
+            reply += ",\"error\":" + jsonQuote(error) + "}";
+        }
+        job.conn->send(reply);
+        job.conn->end();
+    }
+    delete slot.render;
+}
+
+void RenderDaemon::record(const JobMetrics &m, bool ok)
+{
+    std::lock_guard<std::mutex> guard(metricLock);
+    if (!ok)
+    {
+        failed++;
+        return;
+    }
+    completed++;
+    sums.queueMs += m.queueMs, sums.loadMs += m.loadMs, sums.renderMs += m.renderMs;
+    sums.encodeMs += m.encodeMs, sums.totalMs += m.totalMs;
+    if ((int)recent.size() < RECENT_JOBS)
+        recent.push_back(m.totalMs);
+    else
+        recent[recentNext] = m.totalMs;
+    recentNext = (recentNext + 1) % RECENT_JOBS;
+}
+
+std::string RenderDaemon::stats()
+{
+    int queued;
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        queued = queue.size();
+    }
+    int resident;
+    {
+        std::lock_guard<std::mutex> guard(modelLock);
+        resident = models.size();
+    }
+    std::lock_guard<std::mutex> guard(metricLock);
+    std::vector<double> sorted = recent;
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double p) { return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))]; };
+    double n = std::max(1LL, completed);
+    TextureCacheStats tex = TextureCache::instance().getStats();
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+             "{\"ok\":true,\"uptime_s\":%.1f,\"workers\":%d,\"queued\":%d,\"completed\":%lld,\"failed\":%lld,\"models\":%d,"
+             "\"latency_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+             "\"avg_ms\":{\"queue\":%.3f,\"load\":%.3f,\"render\":%.3f,\"encode\":%.3f,\"total\":%.3f},"
+             "\"textures\":{\"hits\":%lld,\"misses\":%lld,\"evictions\":%lld,\"resident_mb\":%.1f,\"entries\":%d}}",
+             (nowMs() - started) / 1000, workerCount, queued, completed, failed, resident,
+             percentile(0.5), percentile(0.95), percentile(0.99), sorted.empty() ? 0.0 : sorted.back(),
+             sums.queueMs / n, sums.loadMs / n, sums.renderMs / n, sums.encodeMs / n, sums.totalMs / n,
+             tex.hits, tex.misses, tex.evictions, tex.residentBytes / 1048576.0, tex.entries);
+    return buf;
+}
+
+bool RenderDaemon::handle(const std::string &line, const std::shared_ptr<Connection> &conn)
+{
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+        return true;
+    Job job;
+    job.received = nowMs();
+    std::string error;
+    if (!JsonValue::parse(line, job.request, error) || job.request.type != JsonValue::OBJECT)
+    {
+        conn->send("{\"ok\":false,\"error\":" + jsonQuote(error.empty() ? "request must be an object" : error) + "}");
+        return true;
+    }
+    std::string cmd = job.request.getString("cmd", "render");
+    job.id = job.request.getString("id", "");
+    if (cmd == "stats")
+    {
+        conn->send(stats());
+        return true;
+    }
+    if (cmd == "unload")
+    {
+        // 正在渲染的任务持有模型的引用, 它们结束后模型才真正释放
+        int n;
+        {
+            std::lock_guard<std::mutex> guard(modelLock);
+            n = models.size();
+            models.clear();
+        }
+        TextureCache::instance().trim();
+        conn->send("{\"ok\":true,\"unloaded\":" + std::to_string(n) + "}");
+        return true;
+    }
+    if (cmd == "shutdown")
+    {
+        conn->send("{\"ok\":true}");
+        return false;
+    }
+    if (cmd != "render")
+    {
+        conn->send("{\"id\":" + jsonQuote(job.id) + ",\"ok\":false,\"error\":" + jsonQuote("unknown cmd " + cmd) + "}");
+        return true;
+    }
+    job.conn = conn;
+    conn->begin();
+    {
+        // 队列满时阻塞这个连接的读取, 客户端随之放慢
+        std::unique_lock<std::mutex> guard(queueLock);
+        notFull.wait(guard, [this] { return stopping || (int)queue.size() < options.queueDepth; });
+        if (!stopping)
+        {
+            queue.push_back(std::move(job));
+            guard.unlock();
+            notEmpty.notify_one();
+            return true;
+        }
+    }
+    conn->send("{\"id\":" + jsonQuote(job.id) + ",\"ok\":false,\"error\":\"shutting down\"}");
+    conn->end();
+    return true;
+}
+
+#ifdef DAEMON_SOCKETS
+// 按行读取套接字, 读端关闭或出错时返回 false
+bool readLine(int fd, std::string &buffer, std::string &line)
+{
+    while (true)
+    {
+        size_t end = buffer.find('\n');
+        if (end != std::string::npos)
+        {
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return true;
+        }
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+        {
+            // 最后一行可以没有换行
+            if (buffer.empty())
+                return false;
+            line.swap(buffer);
+            buffer.clear();
+            return true;
+        }
+        buffer.append(chunk, n);
+    }
+}
+
+int serveSocket(RenderDaemon &daemon, const std::string &path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "socket path too long: " << path << std::endl;
+        return 1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0)
+    {
+        std::cerr << "can't listen on " << path << std::endl;
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+    std::cerr << "daemon: listening on " << path << std::endl;
+    std::mutex clientLock;
+    std::vector<int> clients;
+    std::vector<std::thread> threads;
+    while (true)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+            break; // shutdown 关闭了监听套接字
+        std::lock_guard<std::mutex> guard(clientLock);
+        clients.push_back(fd);
+        threads.emplace_back([&, fd] {
+            auto conn = std::make_shared<Connection>(fd);
+            std::string buffer, line;
+            bool running = true;
+            while (running && readLine(fd, buffer, line))
+                running = daemon.handle(line, conn);
+            conn->drain();
+            if (!running)
+            {
+                // 停止接受新的连接, 正在读的连接也结束读取
+                ::shutdown(listener, SHUT_RDWR);
+                std::lock_guard<std::mutex> guard(clientLock);
+                for (int c : clients)
+                    ::shutdown(c, SHUT_RD);
+            }
+            std::lock_guard<std::mutex> guard(clientLock);
+            clients.erase(std::find(clients.begin(), clients.end(), fd));
+            close(fd);
+        });
+    }
+    {
+        // 已经在读的连接继续处理到读端关闭
+        std::lock_guard<std::mutex> guard(clientLock);
+        for (int c : clients)
+            ::shutdown(c, SHUT_RD);
+    }
+    for (std::thread &t : threads)
+        t.join();
+    close(listener);
+    unlink(path.c_str());
+    return 0;
+}
+#endif
+} // namespace
+
+int runDaemon(const DaemonOptions &options)
+{
+    RenderDaemon daemon(options);
+    int status = 0;
+    if (options.socketPath.empty())
+    {
+        auto conn = std::make_shared<Connection>(-1);
+        std::string line;
+        while (std::getline(std::cin, line) && daemon.handle(line, conn))
+            ;
+        conn->drain();
+    }
+    else
+    {
+#ifdef DAEMON_SOCKETS
+        status = serveSocket(daemon, options.socketPath);
+#else
+        std::cerr << "unix sockets are not supported on this platform" << std::endl;
+        status = 1;
+#endif
+    }
+    daemon.stop();
+    return status;
+}
@@ -0,0 +1,25 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <string>
+
+struct DaemonOptions
+{
+    std::string socketPath; // 为空时从标准输入读请求, 回复写到标准输出
+    int workers = 0;        // 工作线程数, 0 表示按核数
+    int queueDepth = 64;    // 排队任务的上限, 满了以后读请求的连接阻塞
+    bool optimize = false;  // 加载优化过的网格
+};
+
+// 常驻的渲染服务. 每行一个 JSON 请求, 每个请求回复一行 JSON:
+//   {"id": "a", "models": ["obj/african_head/african_head"], "output": "a.qoi",
+//    "width": 256, "height": 256, "eye": [1, 0.8, 3], "center": [0, 0, 0], "up": [0, 1, 0], "light": [1, 1, 1],
+//    "shader": "phong" | "specular", "msaa": 1 | 4, "deferred": false, "format": "qoi",
+//    "lod": 1}          LOD 误差允许投影到屏幕上的像素数, 0 总是用原网格
+//   {"cmd": "stats"}    当前的队列, 延迟分布和资源占用
+//   {"cmd": "unload"}   释放没有任务在用的模型
+//   {"cmd": "shutdown"} 处理完已接收的任务后退出
+// 模型和纹理在任务之间常驻内存. 返回进程退出码
+int runDaemon(const DaemonOptions &options);
+
+#endif
@@ -0,0 +1,411 @@
+#include "framesink.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+static double nowMs()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+FrameSink::FrameSink(const std::string &target) : target(target)
+{
+    file = nullptr;
+    sequence = target.find('%') != std::string::npos;
+    stats = {};
+    frameStart = 0;
+    width = height = bytespp = 0;
+    frame = 0;
+}
+
+FrameSink::~FrameSink()
+{
+    if (file && file != stdout)
+        fclose(file);
+    else if (file)
+        fflush(file);
+}
+
+bool FrameSink::put(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size)
+    {
+        std::cerr << "can't write frame " << frame << " to " << target << std::endl;
+        return false;
+    }
+    stats.bytes += size;
+    return true;
+}
+
+bool FrameSink::begin(int width, int height, int bytespp, int frame)
+{
+    frameStart = nowMs();
+    this->width = width, this->height = height, this->bytespp = bytespp;
+    this->frame = frame;
+    if (!file)
+    {
+        std::string name = target;
+        if (sequence)
+        {
+            std::vector<char> buf(target.size() + 32);
+            snprintf(buf.data(), buf.size(), target.c_str(), frame);
+            name = buf.data();
+        }
+        file = name == "-" ? stdout : fopen(name.c_str(), "wb");
+        if (!file)
+        {
+            std::cerr << "can't open " << name << std::endl;
+            return false;
+        }
+        // 行是一段段写出的, 用大缓冲合并成少量的系统调用
+        if (file != stdout)
+            setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    }
+    return header();
+}
+
+bool FrameSink::row(const unsigned char *pixels)
+{
+    return encode(pixels);
+}
+
+bool FrameSink::end()
+{
+    bool ok = footer();
+    if (sequence)
+    {
+        ok &= fclose(file) == 0;
+        file = nullptr;
+    }
+    else
+    {
+        // 管道另一端的读者可以马上拿到完整的一帧
+        ok &= fflush(file) == 0;
+    }
+    stats.frames++;
+    stats.encodeMs += nowMs() - frameStart;
+    return ok;
+}
+
+bool FrameSink::write(TGAImage &image, int frame)
+{
+    int w = image.get_width(), h = image.get_height(), bpp = image.get_bytespp();
+    if (!begin(w, h, bpp, frame))
+        return false;
+    const unsigned char *data = image.buffer();
+    for (int y = h - 1; y >= 0; y--)
+        if (!row(data + (size_t)y * w * bpp))
+            return false;
+    return end();
+}
+
+// 逐帧首尾相接的 RGB(A), 灰度图展开为 RGB
+class RawSink : public FrameSink
+{
+private:
+    std::vector<unsigned char> line;
+
+protected:
+    virtual bool header()
+    {
+        line.resize((size_t)width * (bytespp == 4 ? 4 : 3));
+        return true;
+    }
+    virtual bool encode(const unsigned char *pixels)
+    {
+        unsigned char *dst = line.data();
+        if (bytespp == 4)
+            for (int x = 0; x < width; x++, pixels += 4, dst += 4)
+                dst[0] = pixels[2], dst[1] = pixels[1], dst[2] = pixels[0], dst[3] = pixels[3];
+        else if (bytespp == 3)
+            for (int x = 0; x < width; x++, pixels += 3, dst += 3)
+                dst[0] = pixels[2], dst[1] = pixels[1], dst[2] = pixels[0];
+        else
+            for (int x = 0; x < width; x++, pixels++, dst += 3)
+                dst[0] = dst[1] = dst[2] = pixels[0];
+        return put(line.data(), line.size());
+    }
+
+public:
+    RawSink(const std::string &target) : FrameSink(target) {}
+};
+
+// 彩色图写成 P6(丢掉 alpha), 灰度图写成 P5
+class PpmSink : public FrameSink
+{
+private:
+    std::vector<unsigned char> line;
+
+protected:
+    virtual bool header()
+    {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "%s\n%d %d\n255\n", bytespp == 1 ? "P5" : "P6", width, height);
+        line.resize((size_t)width * (bytespp == 1 ? 1 : 3));
+        return put(buf, n);
+    }
+    virtual bool encode(const unsigned char *pixels)
+    {
+        if (bytespp == 1)
+            return put(pixels, width);
+        unsigned char *dst = line.data();
+        for (int x = 0; x < width; x++, pixels += bytespp, dst += 3)
+            dst[0] = pixels[2], dst[1] = pixels[1], dst[2] = pixels[0];
+        return put(line.data(), line.size());
+    }
+
+public:
+    PpmSink(const std::string &target) : FrameSink(target) {}
+};
+
+// QOI (https://qoiformat.org). 编码状态跨行保持, 所以可以一行一行地编码
+class QoiSink : public FrameSink
+{
+private:
+    struct Pixel
+    {
+        unsigned char r, g, b, a;
+        bool operator==(const Pixel &p) const { return r == p.r && g == p.g && b == p.b && a == p.a; }
+    };
+    Pixel index[64];
+    Pixel prev;
+    int run;
+    std::vector<unsigned char> out;
+
+    static int hash(const Pixel &p) { return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64; }
+
+    void flushRun()
+    {
+        if (run > 0)
+            out.push_back(0xc0 | (run - 1));
+        run = 0;
+    }
+
+protected:
+    virtual bool header()
+    {
+        unsigned char h[14] = {'q', 'o', 'i', 'f'};
+        for (int i = 0; i < 4; i++)
+        {
+            h[4 + i] = (unsigned)width >> (24 - 8 * i) & 0xff;
+            h[8 + i] = (unsigned)height >> (24 - 8 * i) & 0xff;
+        }
+        h[12] = bytespp == 4 ? 4 : 3;
+        h[13] = 0; // sRGB, alpha 线性
+        memset(index, 0, sizeof(index));
+        prev = {0, 0, 0, 255};
+        run = 0;
+        return put(h, sizeof(h));
+    }
+    virtual bool encode(const unsigned char *pixels)
+    {
+        out.clear();
+        for (int x = 0; x < width; x++, pixels += bytespp)
+        {
+            Pixel p;
+            if (bytespp == 1)
+                p = {pixels[0], pixels[0], pixels[0], 255};
+            else
+                p = {pixels[2], pixels[1], pixels[0], (unsigned char)(bytespp == 4 ? pixels[3] : 255)};
+            if (p == prev)
+            {
+                if (++run == 62)
+                    flushRun();
+                continue;
+            }
+            flushRun();
+            int h = hash(p);
+            if (index[h] == p)
+            {
+                out.push_back(h);
+            }
+            else
+            {
+                index[h] = p;
+                if (p.a == prev.a)
+                {
+                    signed char vr = p.r - prev.r, vg = p.g - prev.g, vb = p.b - prev.b;
+                    signed char vgr = vr - vg, vgb = vb - vg;
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                    {
+                        out.push_back(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                    }
+                    else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+                    {
+                        out.push_back(0x80 | (vg + 32));
+                        out.push_back((vgr + 8) << 4 | (vgb + 8));
+                    }
+                    else
+                    {
+                        unsigned char op[4] = {0xfe, p.r, p.g, p.b};
+                        out.insert(out.end(), op, op + 4);
+                    }
+                }
+                else
+                {
+                    unsigned char op[5] = {0xff, p.r, p.g, p.b, p.a};
+                    out.insert(out.end(), op, op + 5);
+                }
+            }
+            prev = p;
+        }
+        return put(out.data(), out.size());
+    }
+    virtual bool footer()
+    {
+        out.clear();
+        flushRun();
+        unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        out.insert(out.end(), end, end + 8);
+        return put(out.data(), out.size());
+    }
+
+public:
+    QoiSink(const std::string &target) : FrameSink(target) {}
+};
+
+// 与 TGAImage::write_tga_file 相同的 RLE TGA, 包不跨越扫描线
+class TgaSink : public FrameSink
+{
+private:
+    std::vector<unsigned char> out;
+
+protected:
+    virtual bool header()
+    {
+        TGA_Header h;
+        memset((void *)&h, 0, sizeof(h));
+        h.bitsperpixel = bytespp << 3;
+        h.width = width;
+        h.height = height;
+        h.datatypecode = bytespp == TGAImage::GRAYSCALE ? 11 : 10;
+        h.imagedescriptor = 0x20; // top-left origin
+        return put(&h, sizeof(h));
+    }
+    virtual bool encode(const unsigned char *pixels)
+    {
+        out.clear();
+        TGAImage::unload_rle_data(pixels, width, bytespp, out);
+        return put(out.data(), out.size());
+    }
+    virtual bool footer()
+    {
+        unsigned char areas[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        unsigned char signature[18] = {'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'};
+        return put(areas, sizeof(areas)) && put(signature, sizeof(signature));
+    }
+
+public:
+    TgaSink(const std::string &target) : FrameSink(target) {}
+};
+
+FrameSink *FrameSink::create(const std::string &target, FrameFormat format)
+{
+    switch (format)
+    {
+    case FRAME_RAW:
+        return new RawSink(target);
+    case FRAME_PPM:
+        return new PpmSink(target);
+    case FRAME_QOI:
+        return new QoiSink(target);
+    default:
+        return new TgaSink(target);
+    }
+}
+
+FrameFormat FrameSink::formatOf(const std::string &target)
+{
+    size_t dot = target.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : target.substr(dot + 1);
+    if (ext == "raw" || ext == "rgb" || target == "-")
+        return FRAME_RAW;
+    if (ext == "ppm" || ext == "pgm")
+        return FRAME_PPM;
+    if (ext == "qoi")
+        return FRAME_QOI;
+    return FRAME_TGA;
+}
+
+AsyncFrameWriter::AsyncFrameWriter(FrameSink *sink, int width, int height, int bytespp, int buffers) : sink(sink)
+{
+    for (int i = 0; i < std::max(1, buffers); i++)
+        pool.push_back(new TGAImage(width, height, bytespp));
+    idle = pool;
+    done = false;
+    failed = false;
+    waitMs = 0;
+    worker = std::thread(&AsyncFrameWriter::run, this);
+}
+
+AsyncFrameWriter::~AsyncFrameWriter()
+{
+    finish();
+    for (TGAImage *image : pool)
+        delete image;
+}
+
+TGAImage *AsyncFrameWriter::acquire()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (idle.empty())
+    {
+        double start = nowMs();
+        released.wait(guard, [this] { return !idle.empty(); });
+        waitMs += nowMs() - start;
+    }
+    TGAImage *image = idle.back();
+    idle.pop_back();
+    queue.push_back({image, -1, false});
+    return image;
+}
+
+void AsyncFrameWriter::submit(TGAImage *image, int frame)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (Slot &slot : queue)
+            if (slot.image == image)
+                slot.frame = frame, slot.ready = true;
+    }
+    submitted.notify_one();
+}
+
+void AsyncFrameWriter::run()
+{
+    while (true)
+    {
+        Slot job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            submitted.wait(guard, [this] { return queue.empty() ? done : queue.front().ready; });
+            if (queue.empty())
+                return;
+            job = queue.front();
+            queue.pop_front();
+        }
+        // 编码写出时不持有锁, 渲染线程可以同时取用和提交其它缓冲
+        bool ok = sink->write(*job.image, job.frame);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            failed |= !ok;
+            idle.push_back(job.image);
+        }
+        released.notify_one();
+    }
+}
+
+bool AsyncFrameWriter::finish()
+{
+    if (worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+        }
+        submitted.notify_one();
+        worker.join();
+    }
+    return !failed;
+}
@@ -0,0 +1,111 @@
+#ifndef __FRAMESINK_H__
+#define __FRAMESINK_H__
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tgaimage.h"
+
+enum FrameFormat
+{
+    FRAME_RAW, // 逐帧首尾相接的 RGB/RGBA, 可以直接交给 ffmpeg -f rawvideo
+    FRAME_PPM, // P6/P5, 多帧相接可以用 ffmpeg -f image2pipe 读取
+    FRAME_QOI,
+    FRAME_TGA
+};
+
+struct FrameSinkStats
+{
+    int frames;
+    double encodeMs; // 所有帧编码和写出的总耗时
+    size_t bytes;
+};
+
+// 帧输出. 一帧从 begin 开始, 按从上到下的顺序逐行交给 row, 到 end 结束;
+// 每行在交出时就编码写出, 不需要整帧的中间缓冲.
+// target 为 "-" 时写到标准输出, 含有 printf 格式(如 frame%04d.qoi)时每帧一个编号文件,
+// 否则所有帧依次写进同一个文件(也可以是命名管道)
+class FrameSink
+{
+private:
+    std::string target;
+    FILE *file;
+    bool sequence;
+    FrameSinkStats stats;
+    double frameStart;
+
+protected:
+    int width, height, bytespp;
+    int frame;
+
+    bool put(const void *data, size_t size);
+    // 各格式的编码, 像素按 TGAImage 的布局(BGR/BGRA/灰度)给出
+    virtual bool header() = 0;
+    virtual bool encode(const unsigned char *pixels) = 0;
+    virtual bool footer() { return true; }
+
+public:
+    FrameSink(const std::string &target);
+    virtual ~FrameSink();
+    FrameSink(const FrameSink &) = delete;
+    FrameSink &operator=(const FrameSink &) = delete;
+
+    bool begin(int width, int height, int bytespp, int frame);
+    bool row(const unsigned char *pixels);
+    bool end();
+    // 写出整张图. 渲染结果的第 0 行在最下面, 从最后一行开始逐行写出, 不必先翻转
+    bool write(TGAImage &image, int frame);
+    FrameSinkStats getStats() { return stats; }
+
+    // 按格式创建, 输出在第一帧 begin 时才打开
+    static FrameSink *create(const std::string &target, FrameFormat format);
+    // 按扩展名推断格式(.raw/.rgb, .ppm, .qoi), 其余按 TGA
+    static FrameFormat formatOf(const std::string &target);
+};
+
+// 后台写出线程. 渲染线程从池中取一块帧缓冲, 解析到其中后提交; 写出线程按取得缓冲的顺序
+// 编码写出(多个线程并行渲染时, 先取缓冲的帧先写出), 写完后缓冲回到池中.
+// 池中没有空闲缓冲时 acquire 阻塞, 写出跟不上时渲染随之放慢, 排队的帧数不会超过缓冲数.
+// 取得的缓冲必须提交, 否则之后的帧都不会写出
+class AsyncFrameWriter
+{
+private:
+    FrameSink *sink;
+    std::vector<TGAImage *> pool;
+    std::vector<TGAImage *> idle;
+    struct Slot
+    {
+        TGAImage *image;
+        int frame;
+        bool ready;
+    };
+    std::deque<Slot> queue; // 按取得顺序排列的已取出缓冲
+    std::mutex lock;
+    std::condition_variable submitted; // 有新的帧或者要结束
+    std::condition_variable released;  // 有缓冲回到池中
+    bool done;
+    bool failed;
+    double waitMs; // 渲染线程在 acquire 中等待的总时间
+    std::thread worker;
+
+    void run();
+
+public:
+    // buffers 为 2 时即双缓冲: 写出一帧的同时渲染下一帧
+    AsyncFrameWriter(FrameSink *sink, int width, int height, int bytespp, int buffers = 2);
+    ~AsyncFrameWriter();
+    AsyncFrameWriter(const AsyncFrameWriter &) = delete;
+    AsyncFrameWriter &operator=(const AsyncFrameWriter &) = delete;
+
+    TGAImage *acquire();
+    void submit(TGAImage *image, int frame);
+    // 等待已提交的帧全部写出并结束线程, 返回是否全部写出成功
+    bool finish();
+    double getWaitMs() { return waitMs; }
+};
+
+#endif
@@ -39,7 +39,7 @@ struct vec<2, T>
     vec() : x(T()), y(T()) {}
     vec(T X, T Y) : x(X), y(Y) {}
     template <class U>
-    vec<2, T>(const vec<2, U> &v);
+    vec(const vec<2, U> &v);
     T &operator[](const size_t i)
     {
         assert(i < 2);
@@ -62,7 +62,7 @@ struct vec<3, T>
     vec() : x(T()), y(T()), z(T()) {}
     vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
     template <class U>
-    vec<3, T>(const vec<3, U> &v);
+    vec(const vec<3, U> &v);
     T &operator[](const size_t i)
     {
         assert(i < 3);
@@ -0,0 +1,301 @@
+#include "json.h"
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+
+namespace
+{
+// 递归下降解析, 嵌套深度有上限, 恶意输入不会耗尽栈
+class JsonParser
+{
+private:
+    const std::string &text;
+    size_t pos;
+    std::string error;
+    static const int MAX_DEPTH = 64;
+
+    bool fail(const char *what)
+    {
+        if (error.empty())
+            error = std::string(what) + " at offset " + std::to_string(pos);
+        return false;
+    }
+    void skipSpace()
+    {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+            pos++;
+    }
+    bool literal(const char *word)
+    {
+        size_t n = std::char_traits<char>::length(word);
+        if (text.compare(pos, n, word) != 0)
+            return fail("invalid literal");
+        pos += n;
+        return true;
+    }
+    static void appendUtf8(std::string &out, unsigned code)
+    {
+        if (code < 0x80)
+            out += (char)code;
+        else if (code < 0x800)
+            out += (char)(0xc0 | code >> 6), out += (char)(0x80 | (code & 0x3f));
+        else if (code < 0x10000)
+            out += (char)(0xe0 | code >> 12), out += (char)(0x80 | (code >> 6 & 0x3f)), out += (char)(0x80 | (code & 0x3f));
+        else
+            out += (char)(0xf0 | code >> 18), out += (char)(0x80 | (code >> 12 & 0x3f)), out += (char)(0x80 | (code >> 6 & 0x3f)), out += (char)(0x80 | (code & 0x3f));
+    }
+    bool hex4(unsigned &code)
+    {
+        if (pos + 4 > text.size())
+            return fail("truncated escape");
+        auto res = std::from_chars(text.data() + pos, text.data() + pos + 4, code, 16);
+        if (res.ptr != text.data() + pos + 4)
+            return fail("invalid escape");
+        pos += 4;
+        return true;
+    }
+    bool parseString(std::string &out)
+    {
+        pos++; // 开头的引号
+        while (pos < text.size() && text[pos] != '"')
+        {
+            char c = text[pos++];
+            if ((unsigned char)c < 0x20)
+                return fail("control character in string");
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size())
+                return fail("truncated escape");
+            char e = text[pos++];
+            switch (e)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                out += e;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u':
+            {
+                unsigned code;
+                if (!hex4(code))
+                    return false;
+                // 代理对
+                if (code >= 0xd800 && code < 0xdc00 && text.compare(pos, 2, "\\u") == 0)
+                {
+                    pos += 2;
+                    unsigned low;
+                    if (!hex4(low))
+                        return false;
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default:
+                return fail("invalid escape");
+            }
+        }
+        if (pos >= text.size())
+            return fail("unterminated string");
+        pos++;
+        return true;
+    }
+    bool parseNumber(double &out)
+    {
+        size_t start = pos;
+        while (pos < text.size() && (isdigit((unsigned char)text[pos]) || text[pos] == '-' || text[pos] == '+' || text[pos] == '.' || text[pos] == 'e' || text[pos] == 'E'))
+            pos++;
+        auto res = std::from_chars(text.data() + start, text.data() + pos, out);
+        if (res.ec != std::errc() || res.ptr != text.data() + pos)
+        {
+            pos = start;
+            return fail("invalid number");
+        }
+        return true;
+    }
+    bool parseValue(JsonValue &v, int depth)
+    {
+        if (depth > MAX_DEPTH)
+            return fail("nesting too deep");
+        skipSpace();
+        if (pos >= text.size())
+            return fail("unexpected end");
+        char c = text[pos];
+        if (c == '{')
+        {
+            v.type = JsonValue::OBJECT;
+            pos++;
+            skipSpace();
+            if (pos < text.size() && text[pos] == '}')
+                return pos++, true;
+            while (true)
+            {
+                skipSpace();
+                if (pos >= text.size() || text[pos] != '"')
+                    return fail("expected key");
+                std::pair<std::string, JsonValue> field;
+                if (!parseString(field.first))
+                    return false;
+                skipSpace();
+                if (pos >= text.size() || text[pos] != ':')
+                    return fail("expected ':'");
+                pos++;
+                if (!parseValue(field.second, depth + 1))
+                    return false;
+                v.object.push_back(std::move(field));
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == '}')
+                    return pos++, true;
+                return fail("expected ',' or '}'");
+            }
+        }
+        if (c == '[')
+        {
+            v.type = JsonValue::ARRAY;
+            pos++;
+            skipSpace();
+            if (pos < text.size() && text[pos] == ']')
+                return pos++, true;
+            while (true)
+            {
+                v.array.emplace_back();
+                if (!parseValue(v.array.back(), depth + 1))
+                    return false;
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == ']')
+                    return pos++, true;
+                return fail("expected ',' or ']'");
+            }
+        }
+        if (c == '"')
+        {
+            v.type = JsonValue::STRING;
+            return parseString(v.string);
+        }
+        if (c == 't' || c == 'f')
+        {
+            v.type = JsonValue::BOOL;
+            v.boolean = c == 't';
+            return literal(v.boolean ? "true" : "false");
+        }
+        if (c == 'n')
+        {
+            v.type = JsonValue::NUL;
+            return literal("null");
+        }
+        v.type = JsonValue::NUMBER;
+        return parseNumber(v.number);
+    }
+
+public:
+    JsonParser(const std::string &text) : text(text), pos(0) {}
+
+    bool parse(JsonValue &out, std::string &err)
+    {
+        out = JsonValue();
+        bool ok = parseValue(out, 0);
+        skipSpace();
+        if (ok && pos != text.size())
+            ok = fail("trailing characters");
+        err = error;
+        return ok;
+    }
+};
+} // namespace
+
+bool JsonValue::parse(const std::string &text, JsonValue &out, std::string &error)
+{
+    return JsonParser(text).parse(out, error);
+}
+
+const JsonValue *JsonValue::get(const std::string &key) const
+{
+    if (type != OBJECT)
+        return nullptr;
+    for (const auto &field : object)
+        if (field.first == key)
+            return &field.second;
+    return nullptr;
+}
+
+double JsonValue::getNumber(const std::string &key, double def) const
+{
+    const JsonValue *v = get(key);
+    return v && v->type == NUMBER ? v->number : def;
+}
+
+bool JsonValue::getBool(const std::string &key, bool def) const
+{
+    const JsonValue *v = get(key);
+    return v && v->type == BOOL ? v->boolean : def;
+}
+
+std::string JsonValue::getString(const std::string &key, const std::string &def) const
+{
+    const JsonValue *v = get(key);
+    return v && v->type == STRING ? v->string : def;
+}
+
+std::string jsonQuote(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            }
+            else
+                out += c;
+        }
+    }
+    return out + "\"";
+}
@@ -0,0 +1,41 @@
+#ifndef __JSON_H__
+#define __JSON_H__
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// 最小的 JSON 值, 只用于解析渲染服务的请求; 对象按出现顺序保存字段
+struct JsonValue
+{
+    enum Type
+    {
+        NUL,
+        BOOL,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+    Type type = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    // 对象的字段, 不存在或不是对象时返回 nullptr
+    const JsonValue *get(const std::string &key) const;
+    // 按类型取字段, 不存在或类型不符时返回默认值
+    double getNumber(const std::string &key, double def) const;
+    bool getBool(const std::string &key, bool def) const;
+    std::string getString(const std::string &key, const std::string &def) const;
+
+    // 解析一个完整的 JSON 文本, 失败时 error 给出位置和原因
+    static bool parse(const std::string &text, JsonValue &out, std::string &error);
+};
+
+// 转义成 JSON 字符串字面量(包括两边的引号)
+std::string jsonQuote(const std::string &s);
+
+#endif
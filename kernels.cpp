@@ -0,0 +1,162 @@
+#include "kernels.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+// 标量实现, 也是自定义平台上的兜底实现.
+// 各实现的浮点运算顺序必须一致, 否则不同机器上渲染结果会有差异
+static int coverageScalar(const long long e[3], const long long off[3][PACKET_SIZE])
+{
+    int mask = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+        if (((e[0] + off[0][i]) | (e[1] + off[1][i]) | (e[2] + off[2][i])) >= 0)
+            mask |= 1 << i;
+    return mask;
+}
+
+static void interpolateScalar(const float e[3], const float off[3][PACKET_SIZE], const float r[3], const float z[3],
+                              float bar[3][PACKET_SIZE], float depth[PACKET_SIZE])
+{
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        float b0 = (e[0] + off[0][i]) * r[0];
+        float b1 = (e[1] + off[1][i]) * r[1];
+        float b2 = (e[2] + off[2][i]) * r[2];
+        float inv = 1.f / (b0 + b1 + b2);
+        b0 = b0 * inv, b1 = b1 * inv, b2 = b2 * inv;
+        bar[0][i] = b0, bar[1][i] = b1, bar[2][i] = b2;
+        depth[i] = z[2] * b2 + z[1] * b1 + z[0] * b0;
+    }
+}
+
+static int depthTestScalar(const float *zbuffer, const int offset[PACKET_SIZE], const float depth[PACKET_SIZE], int mask)
+{
+    int pass = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+        if ((mask >> i & 1) && zbuffer[offset[i]] < depth[i])
+            pass |= 1 << i;
+    return pass;
+}
+
+#ifdef KERNELS_X86
+// SSE2 是 x86-64 的基线指令集, 一次处理半个包
+static int coverageSSE2(const long long e[3], const long long off[3][PACKET_SIZE])
+{
+    int neg = 0;
+    for (int i = 0; i < PACKET_SIZE; i += 2)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (int k = 0; k < 3; k++)
+            acc = _mm_or_si128(acc, _mm_add_epi64(_mm_set1_epi64x(e[k]), _mm_loadu_si128((const __m128i *)(off[k] + i))));
+        neg |= _mm_movemask_pd(_mm_castsi128_pd(acc)) << i;
+    }
+    return ~neg & ((1 << PACKET_SIZE) - 1);
+}
+
+static void interpolateSSE2(const float e[3], const float off[3][PACKET_SIZE], const float r[3], const float z[3],
+                            float bar[3][PACKET_SIZE], float depth[PACKET_SIZE])
+{
+    for (int i = 0; i < PACKET_SIZE; i += 4)
+    {
+        __m128 b[3];
+        for (int k = 0; k < 3; k++)
+            b[k] = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(e[k]), _mm_loadu_ps(off[k] + i)), _mm_set1_ps(r[k]));
+        __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(_mm_add_ps(b[0], b[1]), b[2]));
+        for (int k = 0; k < 3; k++)
+        {
+            b[k] = _mm_mul_ps(b[k], inv);
+            _mm_storeu_ps(bar[k] + i, b[k]);
+        }
+        __m128 d = _mm_mul_ps(_mm_set1_ps(z[2]), b[2]);
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(z[1]), b[1]));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(z[0]), b[0]));
+        _mm_storeu_ps(depth + i, d);
+    }
+}
+
+static int depthTestSSE2(const float *zbuffer, const int offset[PACKET_SIZE], const float depth[PACKET_SIZE], int mask)
+{
+    int pass = 0;
+    for (int i = 0; i < PACKET_SIZE; i += 4)
+    {
+        float zb[4];
+        for (int j = 0; j < 4; j++)
+            zb[j] = (mask >> (i + j) & 1) ? zbuffer[offset[i + j]] : 0.f;
+        pass |= _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(zb), _mm_loadu_ps(depth + i))) << i;
+    }
+    return pass & mask;
+}
+
+// AVX2 一次处理整个包; 不开启 FMA, 保证与其它实现的舍入一致
+__attribute__((target("avx2"))) static int coverageAVX2(const long long e[3], const long long off[3][PACKET_SIZE])
+{
+    __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+    for (int k = 0; k < 3; k++)
+    {
+        __m256i base = _mm256_set1_epi64x(e[k]);
+        lo = _mm256_or_si256(lo, _mm256_add_epi64(base, _mm256_loadu_si256((const __m256i *)off[k])));
+        hi = _mm256_or_si256(hi, _mm256_add_epi64(base, _mm256_loadu_si256((const __m256i *)(off[k] + 4))));
+    }
+    int neg = _mm256_movemask_pd(_mm256_castsi256_pd(lo)) | _mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+    return ~neg & 0xff;
+}
+
+__attribute__((target("avx2"))) static void interpolateAVX2(const float e[3], const float off[3][PACKET_SIZE], const float r[3], const float z[3],
+                                                            float bar[3][PACKET_SIZE], float depth[PACKET_SIZE])
+{
+    __m256 b[3];
+    for (int k = 0; k < 3; k++)
+        b[k] = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(e[k]), _mm256_loadu_ps(off[k])), _mm256_set1_ps(r[k]));
+    __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_add_ps(_mm256_add_ps(b[0], b[1]), b[2]));
+    for (int k = 0; k < 3; k++)
+    {
+        b[k] = _mm256_mul_ps(b[k], inv);
+        _mm256_storeu_ps(bar[k], b[k]);
+    }
+    __m256 d = _mm256_mul_ps(_mm256_set1_ps(z[2]), b[2]);
+    d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(z[1]), b[1]));
+    d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(z[0]), b[0]));
+    _mm256_storeu_ps(depth, d);
+}
+
+__attribute__((target("avx2"))) static int depthTestAVX2(const float *zbuffer, const int offset[PACKET_SIZE], const float depth[PACKET_SIZE], int mask)
+{
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i active = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+    __m256 zb = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), zbuffer, _mm256_loadu_si256((const __m256i *)offset), _mm256_castsi256_ps(active), 4);
+    return _mm256_movemask_ps(_mm256_cmp_ps(zb, _mm256_loadu_ps(depth), _CMP_LT_OQ)) & mask;
+}
+#endif
+
+static const RasterKernels scalarKernels = {"scalar", coverageScalar, interpolateScalar, depthTestScalar};
+#ifdef KERNELS_X86
+static const RasterKernels sse2Kernels = {"sse2", coverageSSE2, interpolateSSE2, depthTestSSE2};
+static const RasterKernels avx2Kernels = {"avx2", coverageAVX2, interpolateAVX2, depthTestAVX2};
+#endif
+
+static const RasterKernels &selectKernels()
+{
+    const char *force = std::getenv("TINYRENDERER_SIMD");
+    const RasterKernels *kernels = &scalarKernels;
+#ifdef KERNELS_X86
+    kernels = &sse2Kernels;
+    if (__builtin_cpu_supports("avx2"))
+        kernels = &avx2Kernels;
+    if (force && !strcmp(force, "sse2"))
+        kernels = &sse2Kernels;
+#endif
+    if (force && !strcmp(force, "scalar"))
+        kernels = &scalarKernels;
+    std::cerr << "raster kernels: " << kernels->name << std::endl;
+    return *kernels;
+}
+
+const RasterKernels &rasterKernels()
+{
+    static const RasterKernels &kernels = selectKernels();
+    return kernels;
+}
@@ -0,0 +1,25 @@
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+// 光栅化以 4x2 的像素包为单位, 通道 i 对应像素 (x + i % PACKET_WIDTH, y + i / PACKET_WIDTH)
+const int PACKET_WIDTH = 4;
+const int PACKET_HEIGHT = 2;
+const int PACKET_SIZE = PACKET_WIDTH * PACKET_HEIGHT;
+
+// 像素包内核, 运行时按 CPU 特性选择 AVX2 / SSE2 / 标量实现, 三者结果逐位一致
+struct RasterKernels
+{
+    const char *name;
+    // 覆盖测试: e 为包原点的定点边值, off 为各通道相对原点的偏移, 返回三条边都 >= 0 的通道掩码
+    int (*coverage)(const long long e[3], const long long off[3][PACKET_SIZE]);
+    // 属性插值: 边值乘以 r = invArea / w 得到透视校正的重心坐标, 再插值深度
+    void (*interpolate)(const float e[3], const float off[3][PACKET_SIZE], const float r[3], const float z[3],
+                        float bar[3][PACKET_SIZE], float depth[PACKET_SIZE]);
+    // 深度测试: 返回 mask 中满足 zbuffer[offset[i]] < depth[i] 的通道
+    int (*depthTest)(const float *zbuffer, const int offset[PACKET_SIZE], const float depth[PACKET_SIZE], int mask);
+};
+
+// 环境变量 TINYRENDERER_SIMD=scalar|sse2|avx2 可以强制指定实现
+const RasterKernels &rasterKernels();
+
+#endif
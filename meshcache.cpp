@@ -0,0 +1,253 @@
+#include "meshcache.h"
+#include "objloader.h"
+#include "meshopt.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+// 缓存直接按内存布局存放顶点数组
+static_assert(sizeof(MeshVertex) == 32, "MeshVertex must be tightly packed");
+
+namespace
+{
+    struct CornerHash
+    {
+        size_t operator()(const Vec3i &v) const
+        {
+            return ((size_t)v.x * 73856093) ^ ((size_t)(v.y + 1) * 19349663) ^ ((size_t)(v.z + 1) * 83492791);
+        }
+    };
+    struct CornerEqual
+    {
+        bool operator()(const Vec3i &a, const Vec3i &b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+    };
+
+    uint64_t alignUp(uint64_t x)
+    {
+        return (x + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+    }
+
+    // 按 8 字节一组做乘法混合, 速度接近内存带宽
+    uint64_t checksum(const char *data, size_t size)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        size_t n = size / 8;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t w;
+            memcpy(&w, data + i * 8, 8);
+            h = (h ^ w) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+        for (size_t i = n * 8; i < size; i++)
+            h = (h ^ (unsigned char)data[i]) * 0x100000001b3ull;
+        return h;
+    }
+
+    void arraySizes(const MeshView &mesh, uint64_t sizes[MESH_CACHE_ARRAYS])
+    {
+        sizes[0] = mesh.nverts * sizeof(MeshVertex);
+        sizes[1] = (mesh.nfaces + 1) * sizeof(uint32_t);
+        sizes[2] = mesh.nindices * sizeof(uint32_t);
+    }
+
+    // 各数组在文件中的布局
+    void layout(const MeshView &mesh, uint64_t offsets[MESH_CACHE_ARRAYS], uint64_t &fileSize)
+    {
+        uint64_t sizes[MESH_CACHE_ARRAYS];
+        arraySizes(mesh, sizes);
+        uint64_t pos = alignUp(sizeof(MeshCacheHeader));
+        for (int i = 0; i < MESH_CACHE_ARRAYS; i++)
+        {
+            offsets[i] = pos;
+            pos = alignUp(pos + sizes[i]);
+        }
+        fileSize = pos;
+    }
+}
+
+MeshView MeshBuffers::view() const
+{
+    MeshView mesh;
+    mesh.nverts = vertices.size();
+    mesh.nfaces = faceStart.empty() ? 0 : faceStart.size() - 1;
+    mesh.nindices = indices.size();
+    mesh.vertices = vertices.data();
+    mesh.faceStart = faceStart.data();
+    mesh.indices = indices.data();
+    mesh.flags = flags;
+    return mesh;
+}
+
+bool buildMesh(const std::string &objPath, MeshBuffers &out)
+{
+    ObjMesh obj;
+    if (!loadObj(objPath, obj))
+        return false;
+
+    // 面中省略了 vt 的顶点共用一个 (0, 0) 纹理坐标; 省略了 vn 的顶点使用按面积加权的平滑法线
+    int missingUV = -1, generatedNormals = -1;
+    for (Vec3i &c : obj.corners)
+    {
+        if (c.y < 0)
+        {
+            if (missingUV < 0)
+            {
+                missingUV = obj.uvs.size();
+                obj.uvs.push_back(Vec2f(0, 0));
+            }
+            c.y = missingUV;
+        }
+        if (c.z < 0)
+        {
+            if (generatedNormals < 0)
+                generatedNormals = obj.normals.size();
+            c.z = generatedNormals + c.x;
+        }
+    }
+    if (generatedNormals >= 0)
+    {
+        obj.normals.resize(generatedNormals + obj.verts.size(), Vec3f(0, 0, 0));
+        for (int i = 0; i < obj.nfaces(); i++)
+        {
+            const Vec3i *f = &obj.corners[obj.faceStart[i]];
+            Vec3f n = cross(obj.verts[f[1].x] - obj.verts[f[0].x], obj.verts[f[2].x] - obj.verts[f[0].x]);
+            for (int k = obj.faceStart[i]; k < obj.faceStart[i + 1]; k++)
+                obj.normals[generatedNormals + obj.corners[k].x] = obj.normals[generatedNormals + obj.corners[k].x] + n;
+        }
+        for (size_t i = generatedNormals; i < obj.normals.size(); i++)
+            if (obj.normals[i].norm() > 0)
+                obj.normals[i].normalize();
+    }
+
+    // 相同 (v, vt, vn) 组合的顶点只保留一份, 顶点着色器对每个唯一顶点只执行一次
+    std::unordered_map<Vec3i, int, CornerHash, CornerEqual> lookup;
+    lookup.reserve(obj.corners.size());
+    out = MeshBuffers();
+    out.faceStart.assign(obj.faceStart.begin(), obj.faceStart.end());
+    out.indices.resize(obj.corners.size());
+    for (size_t k = 0; k < obj.corners.size(); k++)
+    {
+        const Vec3i &c = obj.corners[k];
+        auto it = lookup.emplace(c, out.vertices.size());
+        if (it.second)
+            out.vertices.push_back({obj.verts[c.x], obj.normals[c.z], obj.uvs[c.y]});
+        out.indices[k] = it.first->second;
+    }
+    // 光栅化只接受三角形
+    triangulateMesh(out);
+    return true;
+}
+
+bool sourceStamp(const std::string &path, SourceStamp &stamp)
+{
+    std::error_code ec;
+    stamp.size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return false;
+    stamp.mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    return !ec;
+}
+
+bool writeMeshCache(const std::string &path, const MeshView &mesh, const SourceStamp &stamp)
+{
+    MeshCacheHeader header = {};
+    memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+    header.version = MESH_CACHE_VERSION;
+    header.nverts = mesh.nverts;
+    header.nfaces = mesh.nfaces;
+    header.nindices = mesh.nindices;
+    header.flags = mesh.flags;
+    header.sourceSize = stamp.size;
+    header.sourceMtime = stamp.mtime;
+    layout(mesh, header.offsets, header.fileSize);
+
+    std::vector<char> data(header.fileSize, 0);
+    const void *arrays[MESH_CACHE_ARRAYS] = {mesh.vertices, mesh.faceStart, mesh.indices};
+    uint64_t sizes[MESH_CACHE_ARRAYS];
+    arraySizes(mesh, sizes);
+    for (int i = 0; i < MESH_CACHE_ARRAYS; i++)
+        if (sizes[i])
+            memcpy(data.data() + header.offsets[i], arrays[i], sizes[i]);
+    header.checksum = checksum(data.data() + sizeof(MeshCacheHeader), data.size() - sizeof(MeshCacheHeader));
+    memcpy(data.data(), &header, sizeof(header));
+
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out.is_open() || !out.write(data.data(), data.size()))
+    {
+        std::cerr << "can't write mesh cache " << path << std::endl;
+        return false;
+    }
+    out.close();
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+    {
+        std::cerr << "can't write mesh cache " << path << ": " << ec.message() << std::endl;
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool mapMeshCache(const std::string &path, MappedFile &file, MeshView &mesh, const SourceStamp *expect)
+{
+    if (!file.open(path))
+        return false;
+    MeshCacheHeader header;
+    bool valid = file.size() >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, file.data(), sizeof(header));
+        valid = !memcmp(header.magic, MESH_CACHE_MAGIC, 4) && header.version == MESH_CACHE_VERSION && header.fileSize == file.size();
+    }
+    if (valid && expect)
+        valid = header.sourceSize == expect->size && header.sourceMtime == expect->mtime;
+    if (valid)
+    {
+        mesh.nverts = header.nverts;
+        mesh.nfaces = header.nfaces;
+        mesh.nindices = header.nindices;
+        mesh.flags = header.flags;
+        uint64_t offsets[MESH_CACHE_ARRAYS], fileSize;
+        layout(mesh, offsets, fileSize);
+        valid = fileSize == header.fileSize && !memcmp(offsets, header.offsets, sizeof(offsets)) &&
+                checksum(file.data() + sizeof(header), file.size() - sizeof(header)) == header.checksum;
+    }
+    if (!valid)
+    {
+        file.close();
+        return false;
+    }
+    // 数组直接指向映射的内存, 不做任何拷贝
+    const char *base = file.data();
+    mesh.vertices = (const MeshVertex *)(base + header.offsets[0]);
+    mesh.faceStart = (const uint32_t *)(base + header.offsets[1]);
+    mesh.indices = (const uint32_t *)(base + header.offsets[2]);
+    return true;
+}
+
+bool loadMesh(const std::string &fileName, MappedFile &file, MeshBuffers &buffers, MeshView &mesh, bool optimize)
+{
+    std::string objPath = fileName + ".obj", cachePath = fileName + ".mesh";
+    SourceStamp stamp;
+    if (!sourceStamp(objPath, stamp))
+        // 只有缓存没有源文件时直接使用缓存
+        return mapMeshCache(cachePath, file, mesh, nullptr);
+    if (mapMeshCache(cachePath, file, mesh, &stamp))
+    {
+        if (!optimize || (mesh.flags & MESH_OPTIMIZED))
+            return true;
+        file.close();
+    }
+    if (!buildMesh(objPath, buffers))
+        return false;
+    if (optimize)
+        optimizeMesh(buffers);
+    mesh = buffers.view();
+    writeMeshCache(cachePath, mesh, stamp);
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef __MESHCACHE_H__
+#define __MESHCACHE_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <span>
+#include "geometry.h"
+#include "mmapfile.h"
+
+// 交错存放的顶点, 32 字节, 顶点阶段读一个顶点只碰一条缓存行
+struct MeshVertex
+{
+    Vec3f position;
+    Vec3f normal;
+    Vec2f uv;
+};
+
+// 渲染使用的网格: 去重后的 (v, vt, vn) 组合组成顶点缓冲, 面是指向顶点的 32 位索引.
+// 数组可能指向映射的缓存文件, 也可能指向 MeshBuffers 中的数据
+struct MeshView
+{
+    int nverts;
+    int nfaces;
+    int nindices;
+    const MeshVertex *vertices;
+    const uint32_t *faceStart; // 第 i 个面的索引为 indices[faceStart[i]] ~ indices[faceStart[i + 1] - 1]
+    const uint32_t *indices;
+    uint32_t flags;
+
+    std::span<const uint32_t> face(int i) const { return {indices + faceStart[i], indices + faceStart[i + 1]}; }
+};
+
+// 从 OBJ 构建网格时数据的实际存放处
+struct MeshBuffers
+{
+    std::vector<MeshVertex> vertices;
+    std::vector<uint32_t> faceStart;
+    std::vector<uint32_t> indices;
+    uint32_t flags = 0;
+
+    MeshView view() const;
+};
+
+// 缓存对应的源文件, 大小或修改时间变化时缓存失效
+struct SourceStamp
+{
+    uint64_t size;
+    int64_t mtime;
+};
+
+const char MESH_CACHE_MAGIC[4] = {'T', 'R', 'M', 'C'};
+const uint32_t MESH_CACHE_VERSION = 3;
+const int MESH_CACHE_ALIGN = 64; // 各数组按缓存行对齐
+const int MESH_CACHE_ARRAYS = 3;
+const uint32_t MESH_OPTIMIZED = 1; // 三角形和顶点已经按缓存局部性和过度绘制重排
+
+// 缓存文件头, 后面依次是 vertices, faceStart, indices 三个数组
+struct MeshCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t nverts;
+    uint32_t nfaces;
+    uint32_t nindices;
+    uint32_t flags;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t offsets[MESH_CACHE_ARRAYS]; // 各数组相对文件开头的偏移
+    uint64_t fileSize;
+    uint64_t checksum; // 文件头之后所有数据的校验和
+};
+
+// 解析 OBJ, 合并相同的 (v, vt, vn) 组合, 补全缺省的纹理坐标和法线, 多边形拆成三角形
+bool buildMesh(const std::string &objPath, MeshBuffers &out);
+bool sourceStamp(const std::string &path, SourceStamp &stamp);
+// 先写临时文件再改名, 其它进程不会读到写了一半的缓存
+bool writeMeshCache(const std::string &path, const MeshView &mesh, const SourceStamp &stamp);
+// 映射缓存文件并校验; expect 不为空时源文件的大小和修改时间必须一致
+bool mapMeshCache(const std::string &path, MappedFile &file, MeshView &mesh, const SourceStamp *expect);
+// 加载 fileName.obj 对应的网格: 缓存有效时直接映射 fileName.mesh, 否则重新解析并更新缓存.
+// optimize 时缓存中的网格必须是优化过的, 否则重新生成
+bool loadMesh(const std::string &fileName, MappedFile &file, MeshBuffers &buffers, MeshView &mesh, bool optimize = false);
+
+#endif
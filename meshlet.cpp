@@ -0,0 +1,261 @@
+#include "meshlet.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+
+namespace
+{
+    const int MESHLET_MIN_TRIANGLES = 64; // 达到这个大小之后, 会让法线锥变宽的面不再加入
+    const float CONE_LIMIT = 0.6f;        // 面法线与锥轴夹角的余弦低于它时算作变宽
+    const float CONE_WEIGHT = 4.f;        // 选面时朝向偏离的惩罚
+
+    // 按位比较的位置, 用来合并纹理接缝两侧拆开的顶点
+    struct PositionKey
+    {
+        uint32_t bits[3];
+        bool operator==(const PositionKey &o) const { return bits[0] == o.bits[0] && bits[1] == o.bits[1] && bits[2] == o.bits[2]; }
+    };
+    struct PositionHash
+    {
+        size_t operator()(const PositionKey &k) const { return (k.bits[0] * 73856093u) ^ (k.bits[1] * 19349663u) ^ (k.bits[2] * 83492791u); }
+    };
+
+    void meshletBounds(const MeshView &mesh, const std::vector<Vec3f> &normals, MeshletTree &tree, Meshlet &m)
+    {
+        // 包围球取包围盒中心, 对细长的簇比质心更紧
+        Vec3f lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        Vec3f hi = -lo;
+        for (int i = 0; i < m.nverts; i++)
+        {
+            Vec3f p = mesh.vertices[tree.vertices[m.firstVertex + i]].position;
+            for (int k = 0; k < 3; k++)
+                lo[k] = std::min(lo[k], p[k]), hi[k] = std::max(hi[k], p[k]);
+        }
+        m.center = (lo + hi) * .5f;
+        m.radius = 0;
+        for (int i = 0; i < m.nverts; i++)
+        {
+            Vec3f d = mesh.vertices[tree.vertices[m.firstVertex + i]].position - m.center;
+            m.radius = std::max(m.radius, d.norm());
+        }
+
+        // 法线锥: 轴取面法线之和, 半角由偏离最大的面法线决定
+        Vec3f axis(0, 0, 0);
+        for (int i = 0; i < m.nfaces; i++)
+            axis = axis + normals[tree.faces[m.firstFace + i]];
+        float len = axis.norm();
+        m.axis = len > 0 ? axis / len : Vec3f(0, 0, 1);
+        float mindot = len > 0 ? 1.f : -1.f;
+        for (int i = 0; i < m.nfaces; i++)
+        {
+            Vec3f n = normals[tree.faces[m.firstFace + i]];
+            if (n * n > 0)
+                mindot = std::min(mindot, n * m.axis);
+        }
+        m.cutoff = mindot > 0 ? std::sqrt(1 - mindot * mindot) : 1.f;
+    }
+
+    // 自顶向下按子节点包围球中心最长轴的中位数划分, 每个叶子是一个 meshlet
+    void buildNode(const std::vector<Meshlet> &meshlets, std::vector<int> &order, std::vector<MeshletNode> &nodes, int index, int first, int count)
+    {
+        Vec3f lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        Vec3f hi = -lo, clo = lo, chi = hi;
+        int nfaces = 0;
+        for (int i = first; i < first + count; i++)
+        {
+            const Meshlet &m = meshlets[order[i]];
+            for (int k = 0; k < 3; k++)
+            {
+                lo[k] = std::min(lo[k], m.center[k] - m.radius), hi[k] = std::max(hi[k], m.center[k] + m.radius);
+                clo[k] = std::min(clo[k], m.center[k]), chi[k] = std::max(chi[k], m.center[k]);
+            }
+            nfaces += m.nfaces;
+        }
+        MeshletNode node;
+        node.center = (lo + hi) * .5f;
+        node.radius = 0;
+        for (int i = first; i < first + count; i++)
+        {
+            const Meshlet &m = meshlets[order[i]];
+            Vec3f d = m.center - node.center;
+            node.radius = std::max(node.radius, d.norm() + m.radius);
+        }
+        node.first = first, node.count = count;
+        node.nfaces = nfaces;
+        node.child = -1;
+        nodes[index] = node;
+        if (count == 1)
+            return;
+
+        int axis = 0;
+        for (int k = 1; k < 3; k++)
+            if (chi[k] - clo[k] > chi[axis] - clo[axis])
+                axis = k;
+        int half = count / 2;
+        std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                         [&](int a, int b) { return meshlets[a].center[axis] < meshlets[b].center[axis]; });
+        int child = nodes.size();
+        nodes[index].child = child;
+        nodes.resize(child + 2);
+        buildNode(meshlets, order, nodes, child, first, half);
+        buildNode(meshlets, order, nodes, child + 1, first + half, count - half);
+    }
+}
+
+std::vector<int> weldPositions(const MeshView &mesh)
+{
+    std::unordered_map<PositionKey, int, PositionHash> first;
+    first.reserve(mesh.nverts);
+    std::vector<int> weld(mesh.nverts);
+    for (int v = 0; v < mesh.nverts; v++)
+    {
+        PositionKey key;
+        memcpy(key.bits, &mesh.vertices[v].position, sizeof(key.bits));
+        weld[v] = first.emplace(key, v).first->second;
+    }
+    return weld;
+}
+
+void buildMeshlets(const MeshView &mesh, MeshletTree &tree)
+{
+    tree = MeshletTree();
+    int nfaces = mesh.nfaces;
+    if (nfaces == 0)
+        return;
+
+    // 面的三个合并后的顶点, 重心和单位法线
+    std::vector<int> weld = weldPositions(mesh);
+    std::vector<int> corners(nfaces * 3);
+    std::vector<Vec3f> centroids(nfaces), normals(nfaces);
+    for (int f = 0; f < nfaces; f++)
+    {
+        std::span<const uint32_t> face = mesh.face(f);
+        Vec3f p[3];
+        for (int k = 0; k < 3; k++)
+        {
+            corners[f * 3 + k] = weld[face[k]];
+            p[k] = mesh.vertices[face[k]].position;
+        }
+        centroids[f] = (p[0] + p[1] + p[2]) / 3.f;
+        Vec3f n = cross(p[1] - p[0], p[2] - p[0]);
+        float len = n.norm();
+        normals[f] = len > 0 ? n / len : Vec3f(0, 0, 0);
+    }
+    // 合并后的顶点到面的邻接表
+    std::vector<int> adjStart(mesh.nverts + 1, 0), adj(nfaces * 3);
+    for (int c : corners)
+        adjStart[c + 1]++;
+    std::partial_sum(adjStart.begin(), adjStart.end(), adjStart.begin());
+    std::vector<int> fill(adjStart.begin(), adjStart.end() - 1);
+    for (int i = 0; i < nfaces * 3; i++)
+        adj[fill[corners[i]]++] = i / 3;
+
+    // 从第一个未用的面开始贪心生长: 与簇共享顶点多的面优先, 其次离簇中心近并且朝向接近的,
+    // 簇保持紧凑, 包围球和法线锥都比较小
+    std::vector<char> used(nfaces, 0);
+    std::vector<int> queued(nfaces, -1); // 面最近一次进入候选的 meshlet
+    std::vector<int> inMeshlet(mesh.nverts, -1); // 合并后的顶点最近一次加入的 meshlet
+    std::vector<int> vertexStamp(mesh.nverts, -1);
+    std::vector<int> candidates;
+    std::vector<Meshlet> meshlets;
+    for (int seed = 0;; seed++)
+    {
+        while (seed < nfaces && used[seed])
+            seed++;
+        if (seed == nfaces)
+            break;
+        int id = meshlets.size();
+        Meshlet m = {};
+        m.firstFace = tree.faces.size();
+        m.firstVertex = tree.vertices.size();
+        Vec3f sumCenter(0, 0, 0), sumNormal(0, 0, 0);
+        candidates.clear();
+        for (int f = seed; f >= 0;)
+        {
+            used[f] = 1;
+            tree.faces.push_back(f);
+            m.nfaces++;
+            sumCenter = sumCenter + centroids[f];
+            sumNormal = sumNormal + normals[f];
+            std::span<const uint32_t> face = mesh.face(f);
+            for (int k = 0; k < 3; k++)
+            {
+                if (vertexStamp[face[k]] != id)
+                {
+                    vertexStamp[face[k]] = id;
+                    tree.vertices.push_back(face[k]);
+                }
+                int w = corners[f * 3 + k];
+                if (inMeshlet[w] == id)
+                    continue;
+                inMeshlet[w] = id;
+                for (int a = adjStart[w]; a < adjStart[w + 1]; a++)
+                    if (!used[adj[a]] && queued[adj[a]] != id)
+                    {
+                        queued[adj[a]] = id;
+                        candidates.push_back(adj[a]);
+                    }
+            }
+            if (m.nfaces == MESHLET_TRIANGLES)
+                break;
+
+            Vec3f center = sumCenter / (float)m.nfaces;
+            Vec3f axis = sumNormal;
+            float len = axis.norm();
+            if (len > 0)
+                axis = axis / len;
+            f = -1;
+            int bestShared = 0;
+            float bestCost = std::numeric_limits<float>::max();
+            size_t kept = 0;
+            for (size_t i = 0; i < candidates.size(); i++)
+            {
+                int c = candidates[i];
+                if (used[c])
+                    continue;
+                candidates[kept++] = c;
+                int shared = (inMeshlet[corners[c * 3]] == id) + (inMeshlet[corners[c * 3 + 1]] == id) + (inMeshlet[corners[c * 3 + 2]] == id);
+                Vec3f d = centroids[c] - center;
+                float cost = d.norm() * (1.f + CONE_WEIGHT * (1.f - normals[c] * axis));
+                if (shared > bestShared || (shared == bestShared && cost < bestCost))
+                {
+                    f = c;
+                    bestShared = shared;
+                    bestCost = cost;
+                }
+            }
+            candidates.resize(kept);
+            // 簇已经够大时保持法线锥窄, 背面剔除才有机会整簇生效
+            if (f >= 0 && m.nfaces >= MESHLET_MIN_TRIANGLES && normals[f] * axis < CONE_LIMIT)
+                break;
+        }
+        m.nverts = tree.vertices.size() - m.firstVertex;
+        meshletBounds(mesh, normals, tree, m);
+        meshlets.push_back(m);
+    }
+
+    std::vector<int> order(meshlets.size());
+    std::iota(order.begin(), order.end(), 0);
+    tree.nodes.resize(1);
+    buildNode(meshlets, order, tree.nodes, 0, 0, meshlets.size());
+
+    // 按叶子顺序重排 meshlet 和它们的面与顶点, 遍历层次时按顺序访问内存
+    std::vector<uint32_t> faces, vertices;
+    faces.reserve(tree.faces.size());
+    vertices.reserve(tree.vertices.size());
+    tree.meshlets.resize(meshlets.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        Meshlet m = meshlets[order[i]];
+        faces.insert(faces.end(), tree.faces.begin() + m.firstFace, tree.faces.begin() + m.firstFace + m.nfaces);
+        vertices.insert(vertices.end(), tree.vertices.begin() + m.firstVertex, tree.vertices.begin() + m.firstVertex + m.nverts);
+        m.firstFace = faces.size() - m.nfaces;
+        m.firstVertex = vertices.size() - m.nverts;
+        tree.meshlets[i] = m;
+    }
+    tree.faces.swap(faces);
+    tree.vertices.swap(vertices);
+}
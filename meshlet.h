@@ -0,0 +1,46 @@
+#ifndef __MESHLET_H__
+#define __MESHLET_H__
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "meshcache.h"
+
+const int MESHLET_TRIANGLES = 128; // 每个 meshlet 最多的三角形数
+
+// 一簇相邻的三角形, 整簇一起做剔除
+struct Meshlet
+{
+    Vec3f center; // 包围球
+    float radius;
+    Vec3f axis;   // 法线锥: 所有面法线与 axis 的夹角不超过 a
+    float cutoff; // sin(a), 法线分布超过半球时为 1, 此时不能整簇剔除背面
+    int firstFace, nfaces;   // MeshletTree::faces 中的范围
+    int firstVertex, nverts; // MeshletTree::vertices 中的范围, 簇内引用的顶点
+};
+
+// 包围球层次的节点, 覆盖 meshlets 中连续的一段
+struct MeshletNode
+{
+    Vec3f center;
+    float radius;
+    int first, count; // meshlet 的范围
+    int nfaces;       // 子树中的三角形数
+    int child;        // 两个子节点为 child 和 child + 1, 叶子为 -1
+};
+
+struct MeshletTree
+{
+    std::vector<Meshlet> meshlets; // 按层次的叶子顺序排列
+    std::vector<uint32_t> faces;    // 按 meshlet 分组的面编号
+    std::vector<uint32_t> vertices; // 按 meshlet 分组的顶点编号, 簇之间可能重复
+    std::vector<MeshletNode> nodes; // nodes[0] 为根
+};
+
+// 每个顶点映射到同一位置上第一个出现的顶点, 纹理接缝和硬边两侧拆开的顶点合并到一起
+std::vector<int> weldPositions(const MeshView &mesh);
+// 按相邻关系贪心地把三角形聚成 meshlet, 计算包围球和法线锥, 再自顶向下建层次.
+// 要求网格已经三角化; 相同位置的顶点(纹理接缝两侧)视为相邻
+void buildMeshlets(const MeshView &mesh, MeshletTree &tree);
+
+#endif
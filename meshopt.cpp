@@ -0,0 +1,404 @@
+#include "meshopt.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace
+{
+    const int FIFO_CACHE_SIZE = 16;        // 统计 ACMR 和划分簇时模拟的 FIFO 缓存
+    const float OVERDRAW_THRESHOLD = 1.05; // 划分簇时允许 ACMR 变差的比例
+    const int OVERDRAW_GRID = 256;         // 统计过度绘制时的光栅化分辨率
+
+    // 用时间戳模拟 FIFO 缓存, 推进 size + 1 次时间戳相当于清空
+    struct FifoCache
+    {
+        std::vector<int> stamp;
+        int time;
+
+        FifoCache(int nverts) : stamp(nverts, -FIFO_CACHE_SIZE - 1), time(0) {}
+        int access(uint32_t v)
+        {
+            if (time - stamp[v] <= FIFO_CACHE_SIZE)
+                return 0;
+            stamp[v] = ++time;
+            return 1;
+        }
+        void clear() { time += FIFO_CACHE_SIZE + 1; }
+    };
+
+    float vertexScore(int cachePos, int remaining)
+    {
+        if (remaining == 0)
+            return -1.f;
+        float score = 0.f;
+        // 最近一个三角形的三个顶点分数固定, 避免总是沿着同一条边扩展成长条
+        if (cachePos >= 0)
+            score = cachePos < 3 ? 0.75f : std::pow(1.f - float(cachePos - 3) / (VERTEX_CACHE_SIZE - 3), 1.5f);
+        // 剩余三角形少的顶点优先处理完, 不要留下孤立的三角形
+        return score + 2.f * std::pow((float)remaining, -0.5f);
+    }
+
+    inline float cross2(Vec2f a, Vec2f b, Vec2f c)
+    {
+        return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    }
+
+    // 耳切法三角化一个多边形, 在 Newell 法线的主轴平面上投影
+    void earClip(const std::vector<MeshVertex> &vertices, const uint32_t *f, int n, std::vector<uint32_t> &out)
+    {
+        Vec3f normal(0, 0, 0);
+        for (int i = 0; i < n; i++)
+        {
+            Vec3f a = vertices[f[i]].position, b = vertices[f[(i + 1) % n]].position;
+            normal.x += (a.y - b.y) * (a.z + b.z);
+            normal.y += (a.z - b.z) * (a.x + b.x);
+            normal.z += (a.x - b.x) * (a.y + b.y);
+        }
+        int axis = 0;
+        for (int k = 1; k < 3; k++)
+            if (std::fabs(normal[k]) > std::fabs(normal[axis]))
+                axis = k;
+        // 丢掉主轴后, 多边形在投影平面上的方向与法线在主轴上的符号一致
+        float sign = normal[axis] < 0 ? -1.f : 1.f;
+        std::vector<Vec2f> p(n);
+        for (int i = 0; i < n; i++)
+        {
+            Vec3f v = vertices[f[i]].position;
+            p[i] = Vec2f(v[(axis + 1) % 3], v[(axis + 2) % 3] * sign);
+        }
+        std::vector<int> ring(n);
+        std::iota(ring.begin(), ring.end(), 0);
+        while (ring.size() > 3)
+        {
+            int m = ring.size();
+            bool found = false;
+            for (int i = 0; i < m && !found; i++)
+            {
+                int a = ring[(i + m - 1) % m], b = ring[i], c = ring[(i + 1) % m];
+                if (cross2(p[a], p[b], p[c]) <= 0)
+                    continue;
+                bool ear = true;
+                for (int j = 0; j < m && ear; j++)
+                {
+                    int q = ring[j];
+                    if (q == a || q == b || q == c || f[q] == f[a] || f[q] == f[b] || f[q] == f[c])
+                        continue;
+                    ear = !(cross2(p[a], p[b], p[q]) >= 0 && cross2(p[b], p[c], p[q]) >= 0 && cross2(p[c], p[a], p[q]) >= 0);
+                }
+                if (!ear)
+                    continue;
+                out.insert(out.end(), {f[a], f[b], f[c]});
+                ring.erase(ring.begin() + i);
+                found = true;
+            }
+            // 自相交或退化的多边形找不到耳朵, 剩下的部分按扇形拆分
+            if (!found)
+            {
+                for (int i = 1; i + 1 < m; i++)
+                    out.insert(out.end(), {f[ring[0]], f[ring[i]], f[ring[i + 1]]});
+                return;
+            }
+        }
+        out.insert(out.end(), {f[ring[0]], f[ring[1]], f[ring[2]]});
+    }
+
+    // 一个簇: 三角形区间和用于排序的朝外程度
+    struct Cluster
+    {
+        int begin, end;
+        float key;
+    };
+}
+
+void triangulateMesh(MeshBuffers &mesh)
+{
+    if (mesh.faceStart.empty())
+        return;
+    int nfaces = mesh.faceStart.size() - 1;
+    std::vector<uint32_t> indices;
+    indices.reserve(mesh.indices.size());
+    for (int i = 0; i < nfaces; i++)
+    {
+        const uint32_t *f = mesh.indices.data() + mesh.faceStart[i];
+        int n = mesh.faceStart[i + 1] - mesh.faceStart[i];
+        if (n == 3)
+            indices.insert(indices.end(), f, f + 3);
+        else if (n > 3)
+            earClip(mesh.vertices, f, n, indices);
+    }
+    mesh.indices.swap(indices);
+    mesh.faceStart.resize(mesh.indices.size() / 3 + 1);
+    for (size_t i = 0; i < mesh.faceStart.size(); i++)
+        mesh.faceStart[i] = i * 3;
+}
+
+void optimizeVertexCache(MeshBuffers &mesh)
+{
+    int ntris = mesh.indices.size() / 3, nverts = mesh.vertices.size();
+    const uint32_t *idx = mesh.indices.data();
+    // 每个顶点相邻的三角形, 按 CSR 存放
+    std::vector<int> offset(nverts + 1, 0), adjacency(ntris * 3), remaining(nverts, 0);
+    for (int i = 0; i < ntris * 3; i++)
+        remaining[idx[i]]++;
+    for (int v = 0; v < nverts; v++)
+        offset[v + 1] = offset[v] + remaining[v];
+    std::vector<int> fill(offset.begin(), offset.end() - 1);
+    for (int i = 0; i < ntris * 3; i++)
+        adjacency[fill[idx[i]]++] = i / 3;
+
+    std::vector<int> cachePos(nverts, -1);
+    std::vector<float> score(nverts);
+    for (int v = 0; v < nverts; v++)
+        score[v] = vertexScore(-1, remaining[v]);
+    std::vector<char> emitted(ntris, 0);
+    std::vector<int> cache, next;
+    std::vector<uint32_t> out;
+    out.reserve(ntris * 3);
+
+    int best = -1, scan = 0;
+    for (int k = 0; k < ntris; k++)
+    {
+        // 缓存中没有候选时, 按原顺序取下一个没有输出的三角形, 保证整体是线性时间
+        if (best < 0)
+        {
+            while (emitted[scan])
+                scan++;
+            best = scan;
+        }
+        emitted[best] = 1;
+        const uint32_t *t = idx + best * 3;
+        out.insert(out.end(), t, t + 3);
+        for (int j = 0; j < 3; j++)
+            remaining[t[j]]--;
+
+        // LRU: 刚用过的三个顶点放到最前面
+        next.assign(t, t + 3);
+        for (int v : cache)
+            if (v != (int)t[0] && v != (int)t[1] && v != (int)t[2])
+                next.push_back(v);
+        for (size_t i = VERTEX_CACHE_SIZE; i < next.size(); i++)
+        {
+            cachePos[next[i]] = -1;
+            score[next[i]] = vertexScore(-1, remaining[next[i]]);
+        }
+        if ((int)next.size() > VERTEX_CACHE_SIZE)
+            next.resize(VERTEX_CACHE_SIZE);
+        cache.swap(next);
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            cachePos[cache[i]] = i;
+            score[cache[i]] = vertexScore(i, remaining[cache[i]]);
+        }
+
+        // 下一个三角形从缓存中顶点的相邻三角形里选分数最高的
+        best = -1;
+        float bestScore = -std::numeric_limits<float>::max();
+        for (int v : cache)
+        {
+            for (int a = offset[v]; a < offset[v + 1]; a++)
+            {
+                int tri = adjacency[a];
+                if (emitted[tri])
+                    continue;
+                float s = score[idx[tri * 3]] + score[idx[tri * 3 + 1]] + score[idx[tri * 3 + 2]];
+                if (s > bestScore)
+                    bestScore = s, best = tri;
+            }
+        }
+    }
+    mesh.indices.swap(out);
+}
+
+void optimizeOverdraw(MeshBuffers &mesh)
+{
+    int ntris = mesh.indices.size() / 3;
+    if (ntris == 0)
+        return;
+    const uint32_t *idx = mesh.indices.data();
+
+    // 硬边界: 三个顶点都未命中的三角形, 从这里断开不会增加缓存未命中
+    std::vector<int> hard;
+    FifoCache fifo(mesh.vertices.size());
+    for (int t = 0; t < ntris; t++)
+        if (fifo.access(idx[t * 3]) + fifo.access(idx[t * 3 + 1]) + fifo.access(idx[t * 3 + 2]) == 3)
+            hard.push_back(t);
+    hard.push_back(ntris);
+
+    // 软边界: 硬边界之间的区间从头开始模拟, 在 ACMR 不比整个区间差太多的位置继续断开
+    std::vector<Cluster> clusters;
+    for (size_t h = 0; h + 1 < hard.size(); h++)
+    {
+        int begin = hard[h], end = hard[h + 1];
+        fifo.clear();
+        int misses = 0;
+        for (int t = begin; t < end; t++)
+            misses += fifo.access(idx[t * 3]) + fifo.access(idx[t * 3 + 1]) + fifo.access(idx[t * 3 + 2]);
+        float limit = OVERDRAW_THRESHOLD * misses / (end - begin);
+        fifo.clear();
+        misses = 0;
+        int start = begin;
+        for (int t = begin; t < end; t++)
+        {
+            misses += fifo.access(idx[t * 3]) + fifo.access(idx[t * 3 + 1]) + fifo.access(idx[t * 3 + 2]);
+            if (t + 1 < end && float(misses) / (t + 1 - start) <= limit && t + 1 - start >= 8)
+            {
+                clusters.push_back({start, t + 1, 0});
+                start = t + 1;
+                fifo.clear();
+                misses = 0;
+            }
+        }
+        clusters.push_back({start, end, 0});
+    }
+
+    // 簇的朝外程度: 簇的中心相对网格中心在簇平均法线上的投影, 越朝外越可能遮挡别的簇
+    Vec3f center(0, 0, 0);
+    float area = 0;
+    std::vector<Vec3f> centroids(clusters.size()), normals(clusters.size());
+    for (size_t c = 0; c < clusters.size(); c++)
+    {
+        Vec3f centroid(0, 0, 0), normal(0, 0, 0);
+        float clusterArea = 0;
+        for (int t = clusters[c].begin; t < clusters[c].end; t++)
+        {
+            Vec3f p0 = mesh.vertices[idx[t * 3]].position, p1 = mesh.vertices[idx[t * 3 + 1]].position, p2 = mesh.vertices[idx[t * 3 + 2]].position;
+            Vec3f n = cross(p1 - p0, p2 - p0);
+            float a = n.norm();
+            centroid = centroid + (p0 + p1 + p2) * (a / 3);
+            normal = normal + n;
+            clusterArea += a;
+        }
+        center = center + centroid;
+        area += clusterArea;
+        centroids[c] = clusterArea > 0 ? centroid * (1 / clusterArea) : mesh.vertices[idx[clusters[c].begin * 3]].position;
+        normals[c] = normal;
+    }
+    if (area > 0)
+        center = center * (1 / area);
+    for (size_t c = 0; c < clusters.size(); c++)
+    {
+        float len = normals[c].norm();
+        clusters[c].key = len > 0 ? (centroids[c] - center) * normals[c] / len : 0;
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster &a, const Cluster &b) { return a.key > b.key; });
+
+    std::vector<uint32_t> out;
+    out.reserve(mesh.indices.size());
+    for (const Cluster &c : clusters)
+        out.insert(out.end(), idx + c.begin * 3, idx + c.end * 3);
+    mesh.indices.swap(out);
+}
+
+void optimizeVertexFetch(MeshBuffers &mesh)
+{
+    std::vector<int> remap(mesh.vertices.size(), -1);
+    std::vector<MeshVertex> vertices;
+    vertices.reserve(mesh.vertices.size());
+    for (uint32_t &i : mesh.indices)
+    {
+        if (remap[i] < 0)
+        {
+            remap[i] = vertices.size();
+            vertices.push_back(mesh.vertices[i]);
+        }
+        i = remap[i];
+    }
+    mesh.vertices.swap(vertices);
+}
+
+void optimizeMesh(MeshBuffers &mesh)
+{
+    optimizeVertexCache(mesh);
+    optimizeOverdraw(mesh);
+    optimizeVertexFetch(mesh);
+    mesh.flags |= MESH_OPTIMIZED;
+}
+
+MeshStats analyzeMesh(const MeshView &mesh)
+{
+    MeshStats stats = {};
+    int ntris = mesh.nindices / 3;
+    if (ntris == 0)
+        return stats;
+    const uint32_t *idx = mesh.indices;
+
+    FifoCache fifo(mesh.nverts);
+    std::vector<char> used(mesh.nverts, 0);
+    int misses = 0, referenced = 0;
+    for (int i = 0; i < ntris * 3; i++)
+    {
+        misses += fifo.access(idx[i]);
+        if (!used[idx[i]])
+            used[idx[i]] = 1, referenced++;
+    }
+    stats.acmr = float(misses) / ntris;
+    stats.atvr = float(misses) / referenced;
+
+    // 过度绘制: 沿 +-x, +-y, +-z 六个方向做正交投影, 按提交顺序光栅化并做深度测试
+    Vec3f lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    Vec3f hi = -lo;
+    for (int v = 0; v < mesh.nverts; v++)
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = std::min(lo[k], mesh.vertices[v].position[k]);
+            hi[k] = std::max(hi[k], mesh.vertices[v].position[k]);
+        }
+    float extent = std::max({hi.x - lo.x, hi.y - lo.y, hi.z - lo.z});
+    if (!(extent > 0))
+        return stats;
+    float scale = (OVERDRAW_GRID - 1) / extent;
+    std::vector<float> zbuffer(OVERDRAW_GRID * OVERDRAW_GRID);
+    long long shaded = 0, covered = 0;
+    for (int view = 0; view < 6; view++)
+    {
+        int axis = view / 2, u = (axis + 1) % 3, w = (axis + 2) % 3;
+        float sign = view % 2 ? -1.f : 1.f;
+        std::fill(zbuffer.begin(), zbuffer.end(), -std::numeric_limits<float>::max());
+        for (int t = 0; t < ntris; t++)
+        {
+            Vec3f p[3];
+            for (int k = 0; k < 3; k++)
+                p[k] = mesh.vertices[idx[t * 3 + k]].position;
+            // 只统计朝向视点的三角形, 与渲染时的背面剔除一致
+            if (cross(p[1] - p[0], p[2] - p[0])[axis] * sign <= 0)
+                continue;
+            float x[3], y[3], z[3];
+            for (int k = 0; k < 3; k++)
+            {
+                x[k] = (p[k][u] - lo[u]) * scale;
+                y[k] = (p[k][w] - lo[w]) * scale;
+                z[k] = p[k][axis] * sign;
+            }
+            float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+            if (area == 0)
+                continue;
+            int x0 = std::max(0, (int)std::floor(std::min({x[0], x[1], x[2]})));
+            int x1 = std::min(OVERDRAW_GRID - 1, (int)std::ceil(std::max({x[0], x[1], x[2]})));
+            int y0 = std::max(0, (int)std::floor(std::min({y[0], y[1], y[2]})));
+            int y1 = std::min(OVERDRAW_GRID - 1, (int)std::ceil(std::max({y[0], y[1], y[2]})));
+            for (int py = y0; py <= y1; py++)
+            {
+                for (int px = x0; px <= x1; px++)
+                {
+                    float cx = px + 0.5f, cy = py + 0.5f;
+                    float b0 = ((x[1] - cx) * (y[2] - cy) - (x[2] - cx) * (y[1] - cy)) / area;
+                    float b1 = ((x[2] - cx) * (y[0] - cy) - (x[0] - cx) * (y[2] - cy)) / area;
+                    float b2 = 1 - b0 - b1;
+                    if (b0 < 0 || b1 < 0 || b2 < 0)
+                        continue;
+                    float depth = z[0] * b0 + z[1] * b1 + z[2] * b2;
+                    float &zb = zbuffer[py * OVERDRAW_GRID + px];
+                    if (zb < depth)
+                    {
+                        covered += zb == -std::numeric_limits<float>::max();
+                        zb = depth;
+                        shaded++;
+                    }
+                }
+            }
+        }
+    }
+    stats.overdraw = covered ? float(shaded) / covered : 0;
+    return stats;
+}
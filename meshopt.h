@@ -0,0 +1,29 @@
+#ifndef __MESHOPT_H__
+#define __MESHOPT_H__
+
+#include "meshcache.h"
+
+const int VERTEX_CACHE_SIZE = 32; // 顶点缓存排序时模拟的缓存大小
+
+// 网格的顶点缓存和过度绘制统计
+struct MeshStats
+{
+    float acmr;     // 平均每个三角形的顶点缓存未命中数, 理想值 0.5
+    float atvr;     // 平均每个顶点被变换的次数, 理想值 1
+    float overdraw; // 在几个轴向视角下着色的片元数 / 覆盖的像素数
+};
+
+// 多边形面用耳切法拆成三角形, 保持原来的环绕方向; 之后每个面都是三角形
+void triangulateMesh(MeshBuffers &mesh);
+// 下面三步要求网格已经三角化
+// Forsyth 的线性时间算法: 按顶点缓存局部性重排三角形
+void optimizeVertexCache(MeshBuffers &mesh);
+// 在缓存排序的基础上按簇重排, 朝外的簇先画, 近似从前到后
+void optimizeOverdraw(MeshBuffers &mesh);
+// 按第一次被引用的顺序重排顶点缓冲, 丢弃没有被引用的顶点
+void optimizeVertexFetch(MeshBuffers &mesh);
+// 依次执行上面三步, 并标记 MESH_OPTIMIZED
+void optimizeMesh(MeshBuffers &mesh);
+MeshStats analyzeMesh(const MeshView &mesh);
+
+#endif
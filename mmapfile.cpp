@@ -0,0 +1,79 @@
+#include "mmapfile.h"
+#include <fstream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MMAPFILE_POSIX
+#endif
+
+MappedFile::MappedFile()
+{
+    ptr = nullptr;
+    length = 0;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string &path)
+{
+    close();
+#ifdef MMAPFILE_POSIX
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    length = st.st_size;
+    if (length > 0)
+    {
+        void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            ::close(fd);
+            length = 0;
+            return false;
+        }
+        // 整个文件都会被读取, 让内核提前预读
+        madvise(p, length, MADV_WILLNEED);
+        ptr = (const char *)p;
+    }
+    // 映射建立后文件描述符就不再需要了
+    ::close(fd);
+    return true;
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        return false;
+    length = in.tellg();
+    fallback.resize(length);
+    in.seekg(0);
+    if (!in.read(fallback.data(), length))
+    {
+        fallback.clear();
+        length = 0;
+        return false;
+    }
+    ptr = fallback.data();
+    return true;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifdef MMAPFILE_POSIX
+    if (ptr)
+        munmap((void *)ptr, length);
+#endif
+    fallback.clear();
+    ptr = nullptr;
+    length = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef __MMAPFILE_H__
+#define __MMAPFILE_H__
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// 只读映射整个文件; 不支持 mmap 的平台退化为一次性读入内存
+class MappedFile
+{
+private:
+    const char *ptr;
+    size_t length;
+    std::vector<char> fallback;
+
+public:
+    MappedFile();
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    bool open(const std::string &path);
+    void close();
+    const char *data() const { return ptr; }
+    size_t size() const { return length; }
+};
+
+#endif
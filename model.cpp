@@ -1,155 +1,189 @@
 #include "model.h"
-#include <fstream>
+#include "texturecache.h"
 #include <string>
 #include <iostream>
-#include <sstream>
 
-Model::Model(std::string fileName)
+Model::Model(std::string fileName, bool optimize)
 {
-    std::ifstream in;
-    in.open(fileName + ".obj", std::ifstream::in);
-    if (in.fail())
+    mesh = MeshView();
+    users = 0;
+    for (int i = 0; i < TEXTURE_SLOTS; i++)
+        loaded[i] = nullptr;
+    texturePaths[DIFFUSE] = fileName + "_diffuse.tga";
+    texturePaths[SPECULAR] = fileName + "_spec.tga";
+    texturePaths[NORMAL] = fileName + "_nm.tga";
+    texturePaths[NORMAL_TANGENT] = fileName + "_nm_tangent.tga";
+    if (!loadMesh(fileName, cache, buffers, mesh, optimize))
     {
         std::cerr << "打开文件失败,文件路径:" << fileName << std::endl;
         return;
     }
-    std::string line;
-    while (!in.eof())
+    // LOD 链: 三角形数依次减半, 与原网格共用顶点缓冲
+    std::vector<LodLevel> levels;
+    simplifyMesh(mesh, levels);
+    lods.resize(levels.size() + 1);
+    lods[0].mesh = mesh;
+    lods[0].error = 0;
+    for (size_t i = 0; i < levels.size(); i++)
     {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) // 点
-        {
-            iss >> trash;
-            Vec3f v;
-            for (int i = 0; i < 3; i++)
-                iss >> v[i];
-            verts.push_back(v);
-        }
-        else if (!line.compare(0, 3, "vt ")) // 点
-        {
-            iss >> trash >> trash;
-            Vec2f v;
-            for (int i = 0; i < 2; i++)
-                iss >> v[i];
-            while (iss >> trash)
-                ;
-            uvs.push_back(v);
-        }
-        else if (!line.compare(0, 3, "vn ")) // 点
-        {
-            iss >> trash >> trash;
-            Vec3f v;
-            for (int i = 0; i < 3; i++)
-                iss >> v[i];
-            normals.push_back(v);
-        }
-        else if (!line.compare(0, 2, "f ")) // 面
-        {
-            iss >> trash;
-            int itrash;
-            std::vector<Vec3i> f;
-            Vec3i idx;
-            while (iss >> idx.x >> trash >> idx.y >> trash >> idx.z)
-            {
-                idx.x--;
-                idx.y--;
-                idx.z--;
-                f.push_back(idx);
-            }
-            faces.push_back(f);
-        }
+        ModelLod &l = lods[i + 1];
+        l.indices.swap(levels[i].indices);
+        l.error = levels[i].error;
+        l.faceStart.resize(l.indices.size() / 3 + 1);
+        for (size_t f = 0; f < l.faceStart.size(); f++)
+            l.faceStart[f] = f * 3;
+        l.mesh = mesh;
+        l.mesh.nfaces = l.faceStart.size() - 1;
+        l.mesh.nindices = l.indices.size();
+        l.mesh.faceStart = l.faceStart.data();
+        l.mesh.indices = l.indices.data();
     }
-    // 读取diffuse
-    diffuse = new Texture((fileName + "_diffuse.tga").c_str());
-    // 读取specular
-    specular = new Texture((fileName + "_spec.tga").c_str());
-    // 读取nm
-    nm = new Texture((fileName + "_nm.tga").c_str());
-    // 读取nm_tangent
-    nm_tangent = new Texture((fileName + "_nm_tangent.tga").c_str());
-    std::cerr
-        << "# v# " << verts.size() << "# vt# " << uvs.size() << " f# " << faces.size() << std::endl;
+    for (ModelLod &l : lods)
+        buildMeshlets(l.mesh, l.meshlets);
+    std::cerr << "# v# " << mesh.nverts << " f# " << mesh.nfaces << " meshlets " << lods[0].meshlets.meshlets.size() << " lods";
+    for (size_t i = 1; i < lods.size(); i++)
+        std::cerr << " " << lods[i].mesh.nfaces;
+    std::cerr << (cache.data() ? " (cached)" : "") << std::endl;
 }
 
 Model::~Model()
 {
+    releaseTextures();
 }
 
+Texture *Model::acquireTexture(int slot)
+{
+    // 多个光栅化线程可能同时第一次采样同一张纹理
+    std::lock_guard<std::mutex> guard(textureLock);
+    if (!textures[slot])
+    {
+        // 法线贴图预先解码成浮点法线
+        bool normalMap = slot == NORMAL || slot == NORMAL_TANGENT;
+        textures[slot] = TextureCache::instance().acquire(texturePaths[slot], normalMap);
+        loaded[slot].store(textures[slot].get(), std::memory_order_release);
+    }
+    return textures[slot].get();
+}
+
+void Model::dropTextures()
+{
+    for (int i = 0; i < TEXTURE_SLOTS; i++)
+    {
+        loaded[i] = nullptr;
+        textures[i].reset();
+    }
+}
+
+void Model::releaseTextures()
+{
+    {
+        std::lock_guard<std::mutex> guard(textureLock);
+        dropTextures();
+    }
+    TextureCache::instance().shrink();
+}
+
+void Model::beginUse()
+{
+    std::lock_guard<std::mutex> guard(textureLock);
+    users++;
+}
+
+void Model::endUse()
+{
+    {
+        // 计数和释放在同一把锁下完成: 另一个 Render 的 beginUse 要么在此之前(这里不释放),
+        // 要么在此之后(它重新获取纹理)
+        std::lock_guard<std::mutex> guard(textureLock);
+        if (--users > 0)
+            return;
+        dropTextures();
+    }
+    TextureCache::instance().shrink();
+}
+
+// 去重后的顶点数
 int Model::nverts()
 {
-    return verts.size();
+    return mesh.nverts;
 }
 
 int Model::nfaces()
 {
-    return faces.size();
+    return mesh.nfaces;
+}
+
+int Model::vertex(int iface, int nthvert)
+{
+    return mesh.indices[mesh.faceStart[iface] + nthvert];
 }
 
 Vec3f Model::vert(int iface, int nthvert)
 {
-    return verts[faces[iface][nthvert].x];
+    return vert(vertex(iface, nthvert));
 }
 
 TGAColor Model::diff(int iface, int nthvert)
 {
-    return diffuse->uv(uv(iface, nthvert));
+    return texture(DIFFUSE)->uv(uv(iface, nthvert));
 }
 
 TGAColor Model::diff(Vec2f uv)
 {
-    return diffuse->uv(uv);
+    return texture(DIFFUSE)->uv(uv);
+}
+
+TGAColor Model::diff(Vec2f uv, Vec2f dx, Vec2f dy)
+{
+    return texture(DIFFUSE)->sample(uv, dx, dy);
 }
 
 TGAColor Model::spec(int iface, int nthvert)
 {
-    return specular->uv(uv(iface, nthvert));
+    return texture(SPECULAR)->uv(uv(iface, nthvert));
 }
 
 TGAColor Model::spec(Vec2f uv)
 {
-    return specular->uv(uv);
+    return texture(SPECULAR)->uv(uv);
+}
+
+TGAColor Model::spec(Vec2f uv, Vec2f dx, Vec2f dy)
+{
+    return texture(SPECULAR)->sample(uv, dx, dy);
 }
 
 Vec3f Model::normal(int iface, int nthvert)
 {
-    return normals[faces[iface][nthvert].z];
+    return normal(vertex(iface, nthvert));
 }
 
 Vec3f Model::normal(Vec2f uv)
 {
-    TGAColor tmp = nm->uv(uv);
-    Vec3f res;
-    for (int i = 0; i < 3; i++)
-        res[i] = tmp[3 - i - 1] / 255.f * 2 - 1;
-    return res;
+    return texture(NORMAL)->normal(uv);
+}
+
+Vec3f Model::normal(Vec2f uv, Vec2f dx, Vec2f dy)
+{
+    return texture(NORMAL)->normal(uv, dx, dy);
 }
 
 Vec3f Model::normal_tangent(int iface, int nthvert)
 {
-    TGAColor tmp = nm_tangent->uv(uv(iface, nthvert));
-    Vec3f res;
-    for (int i = 0; i < 3; i++)
-        res[i] = tmp[3 - i - 1] / 255.f * 2 - 1;
-    return res;
+    return texture(NORMAL_TANGENT)->normal(uv(iface, nthvert));
 }
 
 Vec3f Model::normal_tangent(Vec2f uv)
 {
-    TGAColor tmp = nm_tangent->uv(uv);
-    Vec3f res;
-    for (int i = 0; i < 3; i++)
-        res[i] = tmp[3 - i - 1] / 255.f * 2 - 1;
-    return res;
+    return texture(NORMAL_TANGENT)->normal(uv);
 }
 
-std::vector<Vec3i> Model::face(int idx)
+std::span<const uint32_t> Model::face(int idx)
 {
-    return faces[idx];
+    return mesh.face(idx);
 }
 
 Vec2f Model::uv(int iface, int nthvert)
 {
-    return uvs[faces[iface][nthvert].y];
+    return uv(vertex(iface, nthvert));
 }
@@ -1,38 +1,93 @@
 #ifndef __MODEL_H__
 #define __MODEL_H__
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 #include "texture.h"
 #include "geometry.h"
+#include "meshcache.h"
+#include "meshlet.h"
+#include "simplify.h"
+#include "mmapfile.h"
+
+// 一级细节: 三角形和按它们建立的 meshlet, 顶点缓冲所有级共用
+struct ModelLod
+{
+    MeshView mesh;           // 第 0 级指向模型的网格, 其它级指向下面的数组
+    std::vector<uint32_t> faceStart, indices;
+    MeshletTree meshlets;
+    float error;             // 与第 0 级相比的几何误差(模型空间单位)
+};
 
 class Model
 {
 private:
-    std::vector<Vec3f> verts;              // 点集
-    std::vector<Vec3f> normals;            // 法线集
-    std::vector<std::vector<Vec3i>> faces; // 面集
-    std::vector<Vec2f> uvs;                // 材质
-    Texture *diffuse;
-    Texture *specular;
-    Texture *nm;
-    Texture *nm_tangent;
+    MappedFile cache;      // 映射的网格缓存
+    MeshBuffers buffers;   // 缓存失效时从 OBJ 解析出的数据
+    MeshView mesh;         // 指向上面两者之一
+    std::vector<ModelLod> lods; // 加载时生成, 第 0 级为原网格
+    enum TextureSlot
+    {
+        DIFFUSE,
+        SPECULAR,
+        NORMAL,
+        NORMAL_TANGENT,
+        TEXTURE_SLOTS
+    };
+    // 纹理从 TextureCache 中按需获取, 第一次采样时才加载
+    std::string texturePaths[TEXTURE_SLOTS];
+    std::shared_ptr<Texture> textures[TEXTURE_SLOTS];
+    std::atomic<Texture *> loaded[TEXTURE_SLOTS];
+    std::mutex textureLock;
+    int users; // 正在使用这个模型的绘制数, 受 textureLock 保护
+
+    Texture *texture(int slot)
+    {
+        Texture *t = loaded[slot].load(std::memory_order_acquire);
+        return t ? t : acquireTexture(slot);
+    }
+    Texture *acquireTexture(int slot);
+    void dropTextures(); // 调用者持有 textureLock
 
 public:
-    Model(std::string fileName);
+    // optimize: 使用按顶点缓存和过度绘制重排过的网格
+    Model(std::string fileName, bool optimize = false);
     ~Model();
+    // 放弃对纹理的持有, 之后缓存可以淘汰它们; 再次采样时重新获取.
+    // 不能与采样并发调用
+    void releaseTextures();
+    // Render 在绘制开始和一帧结束时调用. 同一个模型可以被多个线程中的 Render 同时绘制,
+    // 最后一个使用者结束时才放弃纹理
+    void beginUse();
+    void endUse();
     int nverts();
     int nfaces();
+    int vertex(int iface, int nthvert);
+    Vec3f vert(int ivert) { return mesh.vertices[ivert].position; }
     Vec3f vert(int iface, int nthvert);
     TGAColor diff(int iface, int nthvert);
     TGAColor diff(Vec2f uv);
+    // dx, dy: uv 在屏幕 x, y 方向上相邻像素之间的变化量, 按 Texture::setFilter 的方式过滤
+    TGAColor diff(Vec2f uv, Vec2f dx, Vec2f dy);
     TGAColor spec(int iface, int nthvert);
     TGAColor spec(Vec2f uv);
+    TGAColor spec(Vec2f uv, Vec2f dx, Vec2f dy);
+    Vec3f normal(int ivert) { return mesh.vertices[ivert].normal; }
     Vec3f normal(int iface, int nthvert);
     Vec3f normal(Vec2f uv);
+    Vec3f normal(Vec2f uv, Vec2f dx, Vec2f dy);
     Vec3f normal_tangent(int iface, int nthvert);
     Vec3f normal_tangent(Vec2f uv);
-    std::vector<Vec3i> face(int idx);
+    std::span<const uint32_t> face(int idx);
+    std::span<const MeshVertex> vertices() { return {mesh.vertices, (size_t)mesh.nverts}; }
+    std::span<const uint32_t> indices() { return {mesh.indices, (size_t)mesh.nindices}; }
+    // 细节层次, 级数越大三角形越少; 按投影后的误差选择
+    int lodCount() { return lods.size(); }
+    const ModelLod &lod(int level) { return lods[level]; }
+    Vec2f uv(int ivert) { return mesh.vertices[ivert].uv; }
     Vec2f uv(int iface, int nthvert);
 };
 
@@ -0,0 +1,221 @@
+#include "objloader.h"
+#include "mmapfile.h"
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+namespace
+{
+    const size_t CHUNK_SIZE = 1 << 20; // 每块约 1MB, 块边界对齐到行尾
+
+    // 一个分块的解析结果, 负数索引先相对于本块开头之前的计数保存, 合并时再加上前面各块的数量
+    struct ObjChunk
+    {
+        std::vector<Vec3f> verts;
+        std::vector<Vec2f> uvs;
+        std::vector<Vec3f> normals;
+        std::vector<Vec3i> corners;
+        std::vector<int> faceSize;
+        std::vector<int> relative; // 需要修正的索引位置, corner * 3 + 分量
+        int malformed = 0;
+    };
+
+    inline const char *skipSpace(const char *p, const char *end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        return p;
+    }
+
+    inline bool parseFloat(const char *&p, const char *end, float &v)
+    {
+        p = skipSpace(p, end);
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result r = std::from_chars(p, end, v);
+        if (r.ec != std::errc())
+            return false;
+        p = r.ptr;
+        return true;
+    }
+
+    inline bool parseInt(const char *&p, const char *end, int &v)
+    {
+        std::from_chars_result r = std::from_chars(p, end, v);
+        if (r.ec != std::errc())
+            return false;
+        p = r.ptr;
+        return true;
+    }
+
+    // 把 OBJ 中从 1 开始或为负数的索引转换成从 0 开始; count 为本块中已经读到的数量
+    inline bool resolveIndex(int raw, int count, int &index, bool &relative)
+    {
+        if (raw > 0)
+            index = raw - 1, relative = false;
+        else if (raw < 0)
+            index = count + raw, relative = true;
+        else
+            return false;
+        return true;
+    }
+
+    bool parseFace(const char *p, const char *end, ObjChunk &chunk)
+    {
+        int count[3] = {(int)chunk.verts.size(), (int)chunk.uvs.size(), (int)chunk.normals.size()};
+        int n = 0;
+        while ((p = skipSpace(p, end)) < end)
+        {
+            // v, v/vt, v//vn, v/vt/vn
+            Vec3i idx(-1, -1, -1);
+            int corner = chunk.corners.size();
+            for (int k = 0; k < 3; k++)
+            {
+                if (k > 0)
+                {
+                    if (p >= end || *p != '/')
+                        break;
+                    p++;
+                    if (k == 1 && p < end && *p == '/')
+                        continue;
+                }
+                int raw;
+                bool relative;
+                if (!parseInt(p, end, raw) || !resolveIndex(raw, count[k], idx[k], relative))
+                    return false;
+                if (relative)
+                    chunk.relative.push_back(corner * 3 + k);
+            }
+            if (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+                return false;
+            chunk.corners.push_back(idx);
+            n++;
+        }
+        if (n < 3)
+            return false;
+        chunk.faceSize.push_back(n);
+        return true;
+    }
+
+    void parseChunk(const char *p, const char *end, ObjChunk &chunk)
+    {
+        while (p < end)
+        {
+            const char *eol = (const char *)memchr(p, '\n', end - p);
+            if (!eol)
+                eol = end;
+            const char *q = skipSpace(p, eol);
+            bool ok = true;
+            if (eol - q >= 2 && q[0] == 'v' && (q[1] == ' ' || q[1] == '\t')) // 点
+            {
+                Vec3f v;
+                q += 1;
+                ok = parseFloat(q, eol, v.x) && parseFloat(q, eol, v.y) && parseFloat(q, eol, v.z);
+                chunk.verts.push_back(v);
+            }
+            else if (eol - q >= 3 && q[0] == 'v' && q[1] == 't' && (q[2] == ' ' || q[2] == '\t')) // 纹理坐标
+            {
+                Vec2f v(0, 0);
+                q += 2;
+                ok = parseFloat(q, eol, v.x);
+                parseFloat(q, eol, v.y);
+                chunk.uvs.push_back(v);
+            }
+            else if (eol - q >= 3 && q[0] == 'v' && q[1] == 'n' && (q[2] == ' ' || q[2] == '\t')) // 法线
+            {
+                Vec3f v;
+                q += 2;
+                ok = parseFloat(q, eol, v.x) && parseFloat(q, eol, v.y) && parseFloat(q, eol, v.z);
+                chunk.normals.push_back(v);
+            }
+            else if (eol - q >= 2 && q[0] == 'f' && (q[1] == ' ' || q[1] == '\t')) // 面
+            {
+                size_t corners = chunk.corners.size(), relative = chunk.relative.size();
+                ok = parseFace(q + 1, eol, chunk);
+                if (!ok)
+                {
+                    chunk.corners.resize(corners);
+                    chunk.relative.resize(relative);
+                }
+            }
+            // 注释, 分组, 材质等其它记录直接忽略
+            if (!ok)
+                chunk.malformed++;
+            p = eol + 1;
+        }
+    }
+}
+
+bool loadObj(const std::string &path, ObjMesh &mesh)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    const char *data = file.data(), *end = data + file.size();
+
+    // 按大小切块, 每块的结尾推到下一个换行符之后
+    std::vector<const char *> bounds(1, data);
+    while (bounds.back() < end)
+    {
+        const char *p = bounds.back() + std::min<size_t>(CHUNK_SIZE, end - bounds.back());
+        const char *eol = p < end ? (const char *)memchr(p, '\n', end - p) : nullptr;
+        bounds.push_back(eol ? eol + 1 : end);
+    }
+    int nchunks = bounds.size() - 1;
+    std::vector<ObjChunk> chunks(nchunks);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < nchunks; i++)
+        parseChunk(bounds[i], bounds[i + 1], chunks[i]);
+
+    // 合并: 前缀和求出每块在结果中的位置, 再并行拷贝
+    std::vector<Vec3i> base(nchunks + 1, Vec3i(0, 0, 0));
+    std::vector<int> cornerBase(nchunks + 1, 0), faceBase(nchunks + 1, 0);
+    int malformed = 0;
+    for (int i = 0; i < nchunks; i++)
+    {
+        base[i + 1] = base[i] + Vec3i(chunks[i].verts.size(), chunks[i].uvs.size(), chunks[i].normals.size());
+        cornerBase[i + 1] = cornerBase[i] + chunks[i].corners.size();
+        faceBase[i + 1] = faceBase[i] + chunks[i].faceSize.size();
+        malformed += chunks[i].malformed;
+    }
+    mesh.verts.resize(base[nchunks].x);
+    mesh.uvs.resize(base[nchunks].y);
+    mesh.normals.resize(base[nchunks].z);
+    mesh.corners.resize(cornerBase[nchunks]);
+    mesh.faceStart.resize(faceBase[nchunks] + 1);
+    bool valid = true;
+#pragma omp parallel for schedule(dynamic, 1) reduction(&& : valid)
+    for (int i = 0; i < nchunks; i++)
+    {
+        ObjChunk &c = chunks[i];
+        std::copy(c.verts.begin(), c.verts.end(), mesh.verts.begin() + base[i].x);
+        std::copy(c.uvs.begin(), c.uvs.end(), mesh.uvs.begin() + base[i].y);
+        std::copy(c.normals.begin(), c.normals.end(), mesh.normals.begin() + base[i].z);
+        for (int r : c.relative)
+            c.corners[r / 3][r % 3] += base[i][r % 3];
+        Vec3i *corners = mesh.corners.data() + cornerBase[i];
+        for (size_t k = 0; k < c.corners.size(); k++)
+        {
+            Vec3i idx = c.corners[k];
+            valid = valid && idx.x >= 0 && idx.x < base[nchunks].x && idx.y < base[nchunks].y && idx.z < base[nchunks].z &&
+                    idx.y >= -1 && idx.z >= -1;
+            corners[k] = idx;
+        }
+        int start = cornerBase[i];
+        for (size_t k = 0; k < c.faceSize.size(); k++)
+        {
+            mesh.faceStart[faceBase[i] + k] = start;
+            start += c.faceSize[k];
+        }
+    }
+    mesh.faceStart.back() = mesh.corners.size();
+    if (malformed)
+        std::cerr << path << ": skipped " << malformed << " malformed lines" << std::endl;
+    if (!valid)
+    {
+        std::cerr << path << ": face index out of range" << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef __OBJLOADER_H__
+#define __OBJLOADER_H__
+
+#include <string>
+#include <vector>
+#include "geometry.h"
+
+// OBJ 文件解析的结果. 索引都转换成从 0 开始, 面中省略的 vt / vn 记为 -1
+struct ObjMesh
+{
+    std::vector<Vec3f> verts;
+    std::vector<Vec2f> uvs;
+    std::vector<Vec3f> normals;
+    std::vector<Vec3i> corners;  // 所有面的顶点, 每个是一组 (v, vt, vn) 索引
+    std::vector<int> faceStart;  // 第 i 个面的顶点为 corners[faceStart[i]] ~ corners[faceStart[i + 1] - 1]
+    int nfaces() const { return (int)faceStart.size() - 1; }
+};
+
+// 映射整个文件后分块并行解析, 支持 v/vt/vn, v//vn, v/vt 和 v 四种面格式以及负数(相对)索引
+bool loadObj(const std::string &path, ObjMesh &mesh);
+
+#endif
@@ -3,16 +3,27 @@
 #include "render.h"
 #include "tgaimage.h"
 #include <algorithm>
-
-Matrix ModelView;
-Matrix Viewport;
-Matrix Projection;
+#include <numeric>
 
 IShader::~IShader()
 {
 }
 
-void getView(Vec3f pos, Vec3f center, Vec3f up)
+int IShader::fragment(const FragmentPacket &packet, TGAColor colors[PACKET_SIZE])
+{
+    int kept = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        if (!(packet.mask >> i & 1))
+            continue;
+        colors[i] = {0, 0, 0, 255};
+        if (!fragment(Vec3f(packet.bar[0][i], packet.bar[1][i], packet.bar[2][i]), colors[i]))
+            kept |= 1 << i;
+    }
+    return kept;
+}
+
+void RenderContext::getView(Vec3f pos, Vec3f center, Vec3f up)
 {
     Matrix viewT = Matrix::identity();
     viewT[0][3] = -pos.x;
@@ -37,7 +48,7 @@ void getView(Vec3f pos, Vec3f center, Vec3f up)
     ModelView = viewR * viewT;
 }
 
-void getProjection(float near, float far, float fov, float aspect)
+void RenderContext::getProjection(float near, float far, float fov, float aspect)
 {
     float angle = fov / 180.0 * PI;
     Matrix P2O = Matrix::identity();
@@ -61,7 +72,7 @@ void getProjection(float near, float far, float fov, float aspect)
     T[2][3] = -(near + far) / 2.f;
     Projection = O * T * P2O;
 }
-void getViewport(int width, int height)
+void RenderContext::getViewport(int width, int height)
 {
     Matrix vp = Matrix::identity();
     vp[0][0] = width / 2.f;
@@ -79,94 +90,718 @@ Render::Render(int width, int height, IShader *shader, MSAA msaa)
     this->width = width;
     this->height = height;
     this->msaa = msaa;
+    context.getViewport(width, height);
     image = new TGAImage(width, height, TGAImage::RGB);
-    zbuffer = new float[width * height];
-    for (int i = 0; i < width * height; i++)
-        zbuffer[i] = -std::numeric_limits<float>::max();
-    superImage = new TGAImage(width * msaa, height * msaa, TGAImage::RGB);
+    // 采样缓冲按像素连续存放, 同一像素的 msaa * msaa 个采样相邻
+    superImage = new TGAImage(width * msaa * msaa, height, TGAImage::RGB);
     superZbuffer = new float[width * height * msaa * msaa];
     for (int i = 0; i < width * height * msaa * msaa; i++)
         superZbuffer[i] = -std::numeric_limits<float>::max();
+    tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    bins.resize(tilesX * tilesY);
+    for (int i = 0; i < PACKET_SIZE; i++)
+        packetOffset[i] = getSuperIndex(i % PACKET_WIDTH, i / PACKET_WIDTH, 0);
+    blocksX = (width + RASTER_BLOCK - 1) / RASTER_BLOCK;
+    blocksY = (height + RASTER_BLOCK - 1) / RASTER_BLOCK;
+    blockMin = new float[blocksX * blocksY];
+    blockMax = new float[blocksX * blocksY];
+    std::fill(blockMin, blockMin + blocksX * blocksY, -std::numeric_limits<float>::max());
+    std::fill(blockMax, blockMax + blocksX * blocksY, -std::numeric_limits<float>::max());
+    tileMin = new float[tilesX * tilesY];
+    tileMax = new float[tilesX * tilesY];
+    std::fill(tileMin, tileMin + tilesX * tilesY, -std::numeric_limits<float>::max());
+    std::fill(tileMax, tileMax + tilesX * tilesY, -std::numeric_limits<float>::max());
+    stats = {};
+    cullBack = true;
+    clusterCull = true;
+    lodThreshold = 1.f;
+    // 保护带内的顶点映射到屏幕后仍在定点数范围内
+    guardBand = MAX_SCREEN_COORD / 2 / std::max(width, height);
+    deferred = false;
+    gbufferId = nullptr;
+    gbufferBar = nullptr;
+}
+
+void Render::setDeferred(bool enable)
+{
+    // 只能在一帧开始之前切换
+    flush();
+    deferred = enable;
+    if (deferred && !gbufferId)
+    {
+        int n = width * height * msaa * msaa;
+        gbufferId = new int[n];
+        gbufferBar = new float[n * 3];
+        std::fill(gbufferId, gbufferId + n, -1);
+    }
 }
 
 Render::~Render()
 {
+    for (DrawCall &d : draws)
+    {
+        d.shader->model->endUse();
+        delete d.shader;
+    }
     delete image;
     delete superImage;
-    delete[] zbuffer;
     delete[] superZbuffer;
+    delete[] blockMin;
+    delete[] blockMax;
+    delete[] tileMin;
+    delete[] tileMax;
+    delete[] gbufferId;
+    delete[] gbufferBar;
+}
+
+DrawCall &Render::beginDraw(Model *model)
+{
+    DrawCall d;
+    d.shader = shader->clone();
+    d.shader->model = model;
+    d.shader->context = &context;
+    model->beginUse();
+    d.shader->uniform();
+    // 相机前方的点 w 的符号, 由投影矩阵决定
+    d.sign = context.Projection[3][2] > 0 ? -1.f : 1.f;
+
+    VertexBuffer &vb = d.vb;
+    vb.nverts = model->nverts();
+    vb.nvaryings = d.shader->nvaryings();
+    d.nconstants = d.shader->nconstants();
+    for (int i = 0; i < 4; i++)
+        vb.position[i].resize(vb.nverts);
+    vb.varyings.resize(vb.nvaryings);
+    for (int k = 0; k < vb.nvaryings; k++)
+        vb.varyings[k].resize(vb.nverts);
+    d.lod = selectLod(model);
+    stats.lodTriangles += model->nfaces() - model->lod(d.lod).mesh.nfaces;
+    draws.push_back(std::move(d));
+    cullClusters(draws.back(), model);
+    return draws.back();
+}
+
+void Render::endDraw()
+{
+    // 索引三角形, 加载时多边形已经拆成了三角形
+    int id = draws.size() - 1;
+    Model *model = draws[id].shader->model;
+    const ModelLod &lod = model->lod(draws[id].lod);
+    if (!clusterCull)
+    {
+        for (int i = 0; i < lod.mesh.nfaces; i++)
+        {
+            std::span<const uint32_t> face = lod.mesh.face(i);
+            triangle(id, face[0], face[1], face[2]);
+        }
+    }
+    else
+    {
+        const MeshletTree &tree = lod.meshlets;
+        for (int c : draws[id].clusters)
+        {
+            const Meshlet &m = tree.meshlets[c];
+            for (int i = m.firstFace; i < m.firstFace + m.nfaces; i++)
+            {
+                std::span<const uint32_t> face = lod.mesh.face(tree.faces[i]);
+                triangle(id, face[0], face[1], face[2]);
+            }
+        }
+    }
+    flush();
+}
+
+// 裁剪平面, 顶点在平面内侧时距离 >= 0.
+// 本管线中相机前方的点 w 的符号为 sign, 近平面映射到 NDC z = 1, 远平面映射到 -1
+enum ClipPlane
+{
+    CLIP_NEAR,
+    CLIP_FAR,
+    CLIP_LEFT,
+    CLIP_RIGHT,
+    CLIP_BOTTOM,
+    CLIP_TOP,
+    CLIP_GUARD_LEFT,
+    CLIP_GUARD_RIGHT,
+    CLIP_GUARD_BOTTOM,
+    CLIP_GUARD_TOP,
+    CLIP_PLANES
+};
+const int FRUSTUM_PLANES = (1 << CLIP_GUARD_LEFT) - 1;
+// 只需要真正裁剪近平面和保护带, 视口边界由包围盒裁剪处理
+const int CLIPPED_PLANES = 1 << CLIP_NEAR | 1 << CLIP_GUARD_LEFT | 1 << CLIP_GUARD_RIGHT | 1 << CLIP_GUARD_BOTTOM | 1 << CLIP_GUARD_TOP;
+
+static float planeDistance(Vec4f v, int plane, float sign, float guard)
+{
+    switch (plane)
+    {
+    case CLIP_NEAR:
+        return sign * (v[3] - v[2]);
+    case CLIP_FAR:
+        return sign * (v[3] + v[2]);
+    case CLIP_LEFT:
+        return sign * (v[3] + v[0]);
+    case CLIP_RIGHT:
+        return sign * (v[3] - v[0]);
+    case CLIP_BOTTOM:
+        return sign * (v[3] + v[1]);
+    case CLIP_TOP:
+        return sign * (v[3] - v[1]);
+    case CLIP_GUARD_LEFT:
+        return sign * (guard * v[3] + v[0]);
+    case CLIP_GUARD_RIGHT:
+        return sign * (guard * v[3] - v[0]);
+    case CLIP_GUARD_BOTTOM:
+        return sign * (guard * v[3] + v[1]);
+    default:
+        return sign * (guard * v[3] - v[1]);
+    }
+}
+
+// LOD 选择: 模型包围球上离相机最近的点处, 每级的误差投影到屏幕上的像素数不超过阈值时可用.
+// 误差随级数单调增加, 取满足条件的最粗一级
+int Render::selectLod(Model *model)
+{
+    const MeshletTree &tree = model->lod(0).meshlets;
+    if (lodThreshold <= 0 || model->lodCount() <= 1 || tree.nodes.empty())
+        return 0;
+    Vec3f eye = proj<3>(context.ModelView.invert() * embed<4>(Vec3f(0, 0, 0), 1.f));
+    Vec3f d = tree.nodes[0].center - eye;
+    float distance = d.norm() - tree.nodes[0].radius;
+    if (!(distance > 0))
+        return 0;
+    // 距离为 1 处单位长度在屏幕上的像素数
+    float scale = std::max(std::fabs(context.Projection[0][0] * context.Viewport[0][0]), std::fabs(context.Projection[1][1] * context.Viewport[1][1]));
+    int level = 0;
+    while (level + 1 < model->lodCount() && model->lod(level + 1).error * scale / distance <= lodThreshold)
+        level++;
+    return level;
+}
+
+// 簇剔除: 遍历包围球层次, 整个子树在视锥外或被遮挡时一起丢弃, 叶子上再用法线锥剔除背面.
+// 只有通过剔除的簇引用的顶点进入顶点阶段
+void Render::cullClusters(DrawCall &d, Model *model)
+{
+    const ModelLod &lod = model->lod(d.lod);
+    const MeshletTree &tree = lod.meshlets;
+    int nverts = model->nverts();
+    d.clusters.clear();
+    activeVertices.clear();
+    if (!clusterCull || tree.nodes.empty())
+    {
+        activeVertices.resize(nverts);
+        std::iota(activeVertices.begin(), activeVertices.end(), 0);
+        return;
+    }
+    stats.clusters += tree.meshlets.size();
+    Matrix M = context.Projection * context.ModelView;
+    // 视锥平面在模型空间中的方程: 到平面的距离是裁剪坐标的线性函数, 在 M 的各列上求值即得系数
+    Vec4f planes[CLIP_GUARD_LEFT];
+    for (int p = 0; p < CLIP_GUARD_LEFT; p++)
+    {
+        for (int j = 0; j < 4; j++)
+            planes[p][j] = planeDistance(M.col(j), p, d.sign, guardBand);
+        Vec3f n = proj<3>(planes[p]);
+        planes[p] = planes[p] / n.norm();
+    }
+    // 相机在观察空间的原点
+    Vec3f eye = proj<3>(context.ModelView.invert() * embed<4>(Vec3f(0, 0, 0), 1.f));
+
+    vertexUsed.assign(nverts, 0);
+    // (节点, 还需要检查的视锥平面), 包围球完全在某个平面内侧时子节点不再检查它
+    std::vector<std::pair<int, int>> stack = {{0, FRUSTUM_PLANES}};
+    while (!stack.empty())
+    {
+        auto [index, mask] = stack.back();
+        stack.pop_back();
+        const MeshletNode &node = tree.nodes[index];
+        Vec4f center = embed<4>(node.center, 1.f);
+        bool outside = false;
+        for (int p = 0; p < CLIP_GUARD_LEFT && !outside; p++)
+        {
+            if (!(mask >> p & 1))
+                continue;
+            float dist = planes[p] * center;
+            if (dist < -node.radius)
+                outside = true;
+            else if (dist >= node.radius)
+                mask &= ~(1 << p);
+        }
+        if (outside)
+        {
+            stats.clusterFrustum += node.count;
+            stats.clusterTriangles += node.nfaces;
+            continue;
+        }
+        if (node.child < 0 && cullBack)
+        {
+            // 球内每一点看向簇的方向与锥轴的夹角都小于 90 度减去锥的半角时, 簇内所有面都是背面
+            const Meshlet &m = tree.meshlets[node.first];
+            Vec3f v = m.center - eye;
+            if (v * m.axis - m.radius > m.cutoff * (v.norm() + m.radius))
+            {
+                stats.clusterBackfaces++;
+                stats.clusterTriangles += m.nfaces;
+                continue;
+            }
+        }
+        if (sphereOccluded(M, d.sign, node.center, node.radius))
+        {
+            stats.clusterOccluded += node.count;
+            stats.clusterTriangles += node.nfaces;
+            continue;
+        }
+        if (node.child >= 0)
+        {
+            // 左子节点后入栈先访问, 簇按叶子顺序提交
+            stack.push_back({node.child + 1, mask});
+            stack.push_back({node.child, mask});
+            continue;
+        }
+        const Meshlet &m = tree.meshlets[node.first];
+        d.clusters.push_back(node.first);
+        for (int i = m.firstVertex; i < m.firstVertex + m.nverts; i++)
+            vertexUsed[tree.vertices[i]] = 1;
+    }
+    for (int v = 0; v < nverts; v++)
+        if (vertexUsed[v])
+            activeVertices.push_back(v);
 }
 
-static Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P)
+// 包围球外接立方体的 8 个角投影到屏幕, 覆盖的每个 tile 的最远深度都比最近的角更近时球被遮挡.
+// 之前的绘制在 endDraw 中已经光栅化完, tile 深度包含了它们
+bool Render::sphereOccluded(const Matrix &M, float sign, Vec3f center, float radius)
 {
-    Vec2f AB = B - A, AC = C - A, PA = A - P;
-    Vec3f u = Vec3f(AB.x, AC.x, PA.x), v = Vec3f(AB.y, AC.y, PA.y);
-    Vec3f UV = cross(u, v);
-    if (std::fabs(UV.z) > 1e-2)
-        return Vec3f((1.f - (UV.x + UV.y) / UV.z), UV.x / UV.z, UV.y / UV.z);
-    return Vec3f(1, 1, -1);
+    float xmin = std::numeric_limits<float>::max(), xmax = -xmin;
+    float ymin = xmin, ymax = -xmin, zmax = -xmin;
+    for (int i = 0; i < 8; i++)
+    {
+        Vec3f corner = center + Vec3f(i & 1 ? radius : -radius, i & 2 ? radius : -radius, i & 4 ? radius : -radius);
+        Vec4f clip = M * embed<4>(corner, 1.f);
+        // 跨过近平面时投影不再保守
+        if (!(planeDistance(clip, CLIP_NEAR, sign, guardBand) > 0))
+            return false;
+        Vec4f pts = context.Viewport * clip;
+        float x = pts[0] / pts[3], y = pts[1] / pts[3];
+        xmin = std::min(xmin, x), xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y), ymax = std::max(ymax, y);
+        zmax = std::max(zmax, clip[2] / clip[3]);
+    }
+    if (!(xmax >= 0 && ymax >= 0 && xmin < width && ymin < height))
+        return false;
+    int tx0 = std::max(0.f, xmin) / TILE_SIZE, tx1 = std::min<float>(width - 1, xmax) / TILE_SIZE;
+    int ty0 = std::max(0.f, ymin) / TILE_SIZE, ty1 = std::min<float>(height - 1, ymax) / TILE_SIZE;
+    for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++)
+            if (!(zmax < tileMin[ty * tilesX + tx]))
+                return false;
+    return true;
+}
+
+// 在两个顶点之间插值出新顶点, 追加到顶点缓冲末尾
+static int clipVertex(VertexBuffer &vb, int i0, int i1, float t)
+{
+    for (int i = 0; i < 4; i++)
+        vb.position[i].push_back(vb.position[i][i0] + (vb.position[i][i1] - vb.position[i][i0]) * t);
+    for (int k = 0; k < vb.nvaryings; k++)
+        vb.varyings[k].push_back(vb.varyings[k][i0] + (vb.varyings[k][i1] - vb.varyings[k][i0]) * t);
+    return vb.nverts++;
 }
-void Render::triangle(mat<4, 3, float> &clipc)
+
+void Render::triangle(int draw, int i0, int i1, int i2)
 {
-    mat<3, 4, float> pts = (Viewport * clipc).transpose();
-    mat<3, 2, float> pts2;
+    VertexBuffer &vb = draws[draw].vb;
+    float sign = draws[draw].sign;
+    int idx[3] = {i0, i1, i2};
+    int code[3];
     for (int i = 0; i < 3; i++)
-        pts2[i] = proj<2>(pts[i] / pts[i][3]);
+    {
+        Vec4f v = vb.clip(idx[i]);
+        code[i] = 0;
+        for (int plane = 0; plane < CLIP_PLANES; plane++)
+            if (!(planeDistance(v, plane, sign, guardBand) >= 0))
+                code[i] |= 1 << plane;
+    }
+    // 三个顶点都在同一个视锥平面外侧
+    if (code[0] & code[1] & code[2] & FRUSTUM_PLANES)
+    {
+        stats.frustum++;
+        return;
+    }
+    if (!((code[0] | code[1] | code[2]) & CLIPPED_PLANES))
+    {
+        bin(draw, idx);
+        return;
+    }
+
+    // Sutherland-Hodgman 裁剪近平面和保护带, 保护带内的部分只靠包围盒裁剪
+    stats.clipped++;
+    std::vector<int> polygon(idx, idx + 3), next;
+    for (int plane = 0; plane < CLIP_PLANES && polygon.size() >= 3; plane++)
+    {
+        if (!((code[0] | code[1] | code[2]) & CLIPPED_PLANES & (1 << plane)))
+            continue;
+        next.clear();
+        for (size_t i = 0; i < polygon.size(); i++)
+        {
+            int a = polygon[i], b = polygon[(i + 1) % polygon.size()];
+            float da = planeDistance(vb.clip(a), plane, sign, guardBand);
+            float db = planeDistance(vb.clip(b), plane, sign, guardBand);
+            if (da >= 0)
+                next.push_back(a);
+            if ((da >= 0) != (db >= 0))
+                next.push_back(clipVertex(vb, a, b, da / (da - db)));
+        }
+        polygon.swap(next);
+    }
+    for (size_t i = 1; i + 1 < polygon.size(); i++)
+    {
+        int tri[3] = {polygon[0], polygon[i], polygon[i + 1]};
+        bin(draw, tri);
+    }
+}
 
-    Vec2f bboxmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    Vec2f clamp(image->get_width() - 1, image->get_height() - 1);
+void Render::bin(int draw, const int idx[3])
+{
+    BinnedTriangle t;
+    t.draw = draw;
+    t.idx[0] = idx[0], t.idx[1] = idx[1], t.idx[2] = idx[2];
+    const VertexBuffer &vb = draws[draw].vb;
+
+    // 顶点吸附到 1/SUBPIXEL_SCALE 像素的定点网格
+    long long X[3], Y[3];
+    float w[3];
     for (int i = 0; i < 3; i++)
     {
-        for (int j = 0; j < 2; j++)
+        Vec4f clip = vb.clip(t.idx[i]);
+        Vec4f pts = context.Viewport * clip;
+        Vec2f p = proj<2>(pts / pts[3]);
+        if (!(std::fabs(p.x) < MAX_SCREEN_COORD && std::fabs(p.y) < MAX_SCREEN_COORD))
+            return;
+        X[i] = std::llround(p.x * SUBPIXEL_SCALE);
+        Y[i] = std::llround(p.y * SUBPIXEL_SCALE);
+        t.z[i] = clip[2] / clip[3];
+        w[i] = pts[3];
+    }
+    // 透视校正后的深度是顶点深度的凸组合, 不会超出顶点深度的范围
+    t.zmin = std::min({t.z[0], t.z[1], t.z[2]});
+    t.zmax = std::max({t.z[0], t.z[1], t.z[2]});
+
+    // 边方程 E_k(x, y) = a * x + b * y + c, 第 k 条边是顶点 k 的对边
+    for (int k = 0; k < 3; k++)
+    {
+        int i = (k + 1) % 3, j = (k + 2) % 3;
+        t.a[k] = Y[i] - Y[j];
+        t.b[k] = X[j] - X[i];
+        t.c[k] = X[i] * Y[j] - Y[i] * X[j];
+    }
+    // 屏幕空间(y 轴向上)中逆时针的三角形面积为正, 是正面
+    long long area = t.a[0] * X[0] + t.b[0] * Y[0] + t.c[0];
+    if (area == 0)
+    {
+        stats.degenerate++;
+        return;
+    }
+    if (area < 0 && cullBack)
+    {
+        stats.backfaces++;
+        return;
+    }
+    if (area < 0)
+    {
+        area = -area;
+        for (int k = 0; k < 3; k++)
+            t.a[k] = -t.a[k], t.b[k] = -t.b[k], t.c[k] = -t.c[k];
+    }
+    for (int k = 0; k < 3; k++)
+        t.r[k] = 1.f / area / w[k];
+    // top-left 规则: 采样点正好落在边上时, 只有左边和上边算作覆盖,
+    // 共享边上的采样点只会被其中一个三角形绘制
+    for (int k = 0; k < 3; k++)
+        if (!(t.a[k] > 0 || (t.a[k] == 0 && t.b[k] < 0)))
+            t.c[k] -= 1;
+
+    long long xmin = std::min({X[0], X[1], X[2]}), xmax = std::max({X[0], X[1], X[2]});
+    long long ymin = std::min({Y[0], Y[1], Y[2]}), ymax = std::max({Y[0], Y[1], Y[2]});
+    t.bboxmin = Vec2i(std::max(0LL, xmin >> SUBPIXEL_BITS), std::max(0LL, ymin >> SUBPIXEL_BITS));
+    t.bboxmax = Vec2i(std::min<long long>(width - 1, xmax >> SUBPIXEL_BITS), std::min<long long>(height - 1, ymax >> SUBPIXEL_BITS));
+    if (t.bboxmin.x > t.bboxmax.x || t.bboxmin.y > t.bboxmax.y)
+        return;
+
+    // 分块前端: 把三角形放入包围盒覆盖的所有 tile, 已经被 tile 中最远深度挡住的 tile 直接跳过
+    int id = triangles.size();
+    bool binned = false;
+    for (int ty = t.bboxmin.y / TILE_SIZE; ty <= t.bboxmax.y / TILE_SIZE; ty++)
+    {
+        for (int tx = t.bboxmin.x / TILE_SIZE; tx <= t.bboxmax.x / TILE_SIZE; tx++)
+        {
+            int tile = ty * tilesX + tx;
+            if (t.zmax < tileMin[tile])
+            {
+                stats.tiles++;
+                continue;
+            }
+            bins[tile].push_back(id);
+            binned = true;
+        }
+    }
+    if (!binned)
+    {
+        stats.triangles++;
+        return;
+    }
+    // 三角形建立: 只对会被光栅化的三角形做一次
+    DrawCall &d = draws[draw];
+    t.setup = d.constants.size();
+    d.constants.resize(t.setup + d.nconstants);
+    d.shader->setup(vb, t.idx, d.constants.data() + t.setup);
+    t.gid = -1;
+    if (deferred)
+    {
+        t.gid = gTriangles.size();
+        gTriangles.push_back({draw, {idx[0], idx[1], idx[2]}, t.setup});
+    }
+    triangles.push_back(t);
+}
+
+void Render::flush()
+{
+    // 后端: 每个 tile 独占自己的深度和颜色区域, 不需要加锁;
+    // tile 内按提交顺序光栅化, 因此结果与单线程逐个三角形绘制完全一致
+    std::vector<int> tiles;
+    for (int i = 0; i < tilesX * tilesY; i++)
+        if (!bins[i].empty())
+            tiles.push_back(i);
+    long long culledTiles = 0, culledBlocks = 0;
+#pragma omp parallel reduction(+ : culledTiles, culledBlocks)
+    {
+        // 每个线程为每个绘制调用持有一份着色器拷贝, 按需创建
+        std::vector<IShader *> shaders(draws.size(), nullptr);
+#pragma omp for schedule(dynamic, 1)
+        for (int k = 0; k < (int)tiles.size(); k++)
+        {
+            CullStats cull = {};
+            for (int id : bins[tiles[k]])
+            {
+                BinnedTriangle &t = triangles[id];
+                if (!deferred && !shaders[t.draw])
+                    shaders[t.draw] = draws[t.draw].shader->clone();
+                (this->*draws[t.draw].raster)(t, shaders[t.draw], tiles[k], cull);
+            }
+            culledTiles += cull.tiles;
+            culledBlocks += cull.blocks;
+        }
+        for (IShader *s : shaders)
+            delete s;
+    }
+    stats.tiles += culledTiles;
+    stats.blocks += culledBlocks;
+    triangles.clear();
+    for (std::vector<int> &bin : bins)
+        bin.clear();
+}
+
+void Render::updateBlock(int bx, int by)
+{
+    float zmin = std::numeric_limits<float>::max(), zmax = -std::numeric_limits<float>::max();
+    int x0 = bx * RASTER_BLOCK, x1 = std::min(x0 + RASTER_BLOCK, width);
+    int y0 = by * RASTER_BLOCK, y1 = std::min(y0 + RASTER_BLOCK, height);
+    for (int y = y0; y < y1; y++)
+    {
+        // 一行内各像素的采样是连续存放的
+        float *z = superZbuffer + getSuperIndex(x0, y, 0);
+        for (int i = 0; i < (x1 - x0) * msaa * msaa; i++)
+        {
+            zmin = std::min(zmin, z[i]);
+            zmax = std::max(zmax, z[i]);
+        }
+    }
+    blockMin[by * blocksX + bx] = zmin;
+    blockMax[by * blocksX + bx] = zmax;
+}
+
+void Render::updateTile(int tile)
+{
+    int bx0 = tile % tilesX * (TILE_SIZE / RASTER_BLOCK), bx1 = std::min(bx0 + TILE_SIZE / RASTER_BLOCK, blocksX);
+    int by0 = tile / tilesX * (TILE_SIZE / RASTER_BLOCK), by1 = std::min(by0 + TILE_SIZE / RASTER_BLOCK, blocksY);
+    float zmin = std::numeric_limits<float>::max(), zmax = -std::numeric_limits<float>::max();
+    for (int by = by0; by < by1; by++)
+    {
+        for (int bx = bx0; bx < bx1; bx++)
         {
-            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], pts2[i][j]));
-            bboxmax[j] = std::min(clamp[j], std::max(bboxmax[j], pts2[i][j]));
+            zmin = std::min(zmin, blockMin[by * blocksX + bx]);
+            zmax = std::max(zmax, blockMax[by * blocksX + bx]);
         }
     }
-    Vec2i P;
-    TGAColor color(0, 0, 0, 255), rColor(0, 0, 0, 255);
-    for (P.x = int(bboxmin.x); P.x <= int(bboxmax.x + .5); P.x++)
+    tileMin[tile] = zmin;
+    tileMax[tile] = zmax;
+}
+
+void Render::shade()
+{
+    // 着色阶段: 以像素包为单位, 包内引用同一个三角形的通道一起着色.
+    // 一个通道的多个采样可能属于不同三角形, 每个 (像素, 三角形) 只着色一次
+    int nsamples = msaa * msaa;
+    int packetsX = (width + PACKET_WIDTH - 1) / PACKET_WIDTH;
+    int packetsY = (height + PACKET_HEIGHT - 1) / PACKET_HEIGHT;
+#pragma omp parallel
     {
-        for (P.y = int(bboxmin.y); P.y <= int(bboxmax.y + .5); P.y++)
+        std::vector<IShader *> shaders(draws.size(), nullptr);
+        FragmentPacket packet;
+        TGAColor colors[PACKET_SIZE];
+        int ids[PACKET_SIZE][4];
+#pragma omp for schedule(dynamic, 1)
+        for (int py = 0; py < packetsY; py++)
         {
-            for (int i = 0; i < msaa; i++)
+            for (int px = 0; px < packetsX; px++)
             {
-                for (int j = 0; j < msaa; j++)
+                packet.x = px * PACKET_WIDTH, packet.y = py * PACKET_HEIGHT;
+                // pending 的第 i * 4 + s 位表示通道 i 的采样 s 还没有着色
+                unsigned pending = 0;
+                for (int i = 0; i < PACKET_SIZE; i++)
                 {
-                    color = {0, 0, 0, 255};
-                    Vec2i p;
-                    p.x = P.x + 1.f / msaa * i + 1.f / msaa / 2.f, p.y = P.y + 1.f / msaa * j + 1.f / msaa / 2.f;
-                    Vec3f bc_screen = barycentric(proj<2>(pts[0] / pts[0][3]), proj<2>(pts[1] / pts[1][3]), proj<2>(pts[2] / pts[2][3]), proj<2>(p));
-                    Vec3f bc_clip = Vec3f(bc_screen.x / pts[0][3], bc_screen.y / pts[1][3], bc_screen.z / pts[2][3]);
-                    bc_clip = bc_clip / (bc_clip.x + bc_clip.y + bc_clip.z);
-                    if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0)
+                    int x = packet.x + i % PACKET_WIDTH, y = packet.y + i / PACKET_WIDTH;
+                    if (x >= width || y >= height)
                         continue;
-                    float frag_depth = 0;
-                    for (int k = 0; k < 3; k++)
-                        frag_depth += clipc[2][k] / clipc[3][k] * bc_clip[k];
-                    int idx = getSuperIndex(int(P.x * msaa + i), int(P.y * msaa + j));
-                    if (superZbuffer[idx] < frag_depth)
+                    for (int s = 0; s < nsamples; s++)
                     {
-
-                        bool discard = shader->fragment(bc_clip, color);
-                        if (!discard)
+                        ids[i][s] = gbufferId[getSuperIndex(x, y, s)];
+                        if (ids[i][s] >= 0)
+                            pending |= 1u << (i * 4 + s);
+                    }
+                }
+                while (pending)
+                {
+                    int first = __builtin_ctz(pending);
+                    int id = ids[first / 4][first % 4];
+                    packet.mask = 0;
+                    for (int i = 0; i < PACKET_SIZE; i++)
+                    {
+                        for (int s = 0; s < nsamples; s++)
                         {
-                            superZbuffer[idx] = frag_depth;
-                            superImage->set(P.x * msaa + i, P.y * msaa + j, color);
-                            rColor = {0, 0, 0, 255};
-                            for (int ii = 0; ii < msaa; ii++)
+                            if (!(pending >> (i * 4 + s) & 1) || ids[i][s] != id)
+                                continue;
+                            // 同一像素上属于该三角形的采样记录的是同一个着色点
+                            if (!(packet.mask >> i & 1))
                             {
-                                for (int jj = 0; jj < msaa; jj++)
-                                {
-                                    rColor = rColor + superImage->get(P.x * msaa + ii, P.y * msaa + jj) * (1.f / msaa / msaa);
-                                }
+                                int idx = getSuperIndex(packet.x + i % PACKET_WIDTH, packet.y + i / PACKET_WIDTH, s);
+                                for (int k = 0; k < 3; k++)
+                                    packet.bar[k][i] = gbufferBar[idx * 3 + k];
+                                packet.mask |= 1 << i;
                             }
-                            image->set(P.x, P.y, rColor);
+                        }
+                    }
+                    const GTriangle &t = gTriangles[id];
+                    // G-buffer 只有被覆盖采样的重心坐标, 导数需要整个包的像素中心:
+                    // 由顶点的齐次屏幕坐标 (x, y, w) 直接求出透视校正的重心坐标
+                    const VertexBuffer &vb = draws[t.draw].vb;
+                    Vec3f h[3], edge[3];
+                    for (int k = 0; k < 3; k++)
+                    {
+                        Vec4f pts = context.Viewport * vb.clip(t.idx[k]);
+                        h[k] = Vec3f(pts[0], pts[1], pts[3]);
+                    }
+                    for (int k = 0; k < 3; k++)
+                        edge[k] = cross(h[(k + 1) % 3], h[(k + 2) % 3]);
+                    float bar[3][PACKET_SIZE];
+                    for (int i = 0; i < PACKET_SIZE; i++)
+                    {
+                        Vec3f p(packet.x + i % PACKET_WIDTH + .5f, packet.y + i / PACKET_WIDTH + .5f, 1.f);
+                        float b[3] = {edge[0] * p, edge[1] * p, edge[2] * p};
+                        float inv = 1.f / (b[0] + b[1] + b[2]);
+                        for (int k = 0; k < 3; k++)
+                            bar[k][i] = b[k] * inv;
+                    }
+                    quadDerivatives(bar, packet);
+                    if (!shaders[t.draw])
+                        shaders[t.draw] = draws[t.draw].shader->clone();
+                    shaders[t.draw]->assemble(vb, t.idx, draws[t.draw].constants.data() + t.setup);
+                    int kept = shaders[t.draw]->fragment(packet, colors);
+                    for (int i = 0; i < PACKET_SIZE; i++)
+                    {
+                        if (!(packet.mask >> i & 1))
+                            continue;
+                        int x = packet.x + i % PACKET_WIDTH, y = packet.y + i / PACKET_WIDTH;
+                        for (int s = 0; s < nsamples; s++)
+                        {
+                            if (!(pending >> (i * 4 + s) & 1) || ids[i][s] != id)
+                                continue;
+                            pending &= ~(1u << (i * 4 + s));
+                            if (kept >> i & 1)
+                                superImage->set(x * nsamples + s, y, colors[i]);
+                            gbufferId[getSuperIndex(x, y, s)] = -1;
                         }
                     }
                 }
             }
         }
+        for (IShader *s : shaders)
+            delete s;
+    }
+    gTriangles.clear();
+}
+
+void Render::resolve()
+{
+    resolve(image);
+}
+
+void Render::resolve(TGAImage *target)
+{
+    flush();
+    if (deferred)
+        shade();
+    // 本帧的采样已经全部完成; 模型没有被其它 Render 使用时放弃持有纹理, 超出预算时纹理缓存可以淘汰它们
+    for (DrawCall &d : draws)
+    {
+        d.shader->model->endUse();
+        delete d.shader;
+    }
+    draws.clear();
+    // 把采样缓冲平均到最终图像, 整帧只做一次
+    int nsamples = msaa * msaa;
+    unsigned char *samples = superImage->buffer();
+    unsigned char *pixels = target->buffer();
+    int bpp = superImage->get_bytespp();
+#pragma omp parallel for
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            unsigned char *src = samples + getSuperIndex(x, y, 0) * bpp;
+            unsigned char *dst = pixels + getIndex(x, y) * bpp;
+            for (int c = 0; c < bpp; c++)
+            {
+                int sum = 0;
+                for (int s = 0; s < nsamples; s++)
+                    sum += src[s * bpp + c];
+                dst[c] = (sum + nsamples / 2) / nsamples;
+            }
+        }
+    }
+}
+
+void Render::clear()
+{
+    // 丢弃还没有提交的绘制
+    for (DrawCall &d : draws)
+    {
+        d.shader->model->endUse();
+        delete d.shader;
     }
+    draws.clear();
+    triangles.clear();
+    for (std::vector<int> &bin : bins)
+        bin.clear();
+    gTriangles.clear();
+    int n = width * height * msaa * msaa;
+    superImage->clear();
+    std::fill(superZbuffer, superZbuffer + n, -std::numeric_limits<float>::max());
+    std::fill(blockMin, blockMin + blocksX * blocksY, -std::numeric_limits<float>::max());
+    std::fill(blockMax, blockMax + blocksX * blocksY, -std::numeric_limits<float>::max());
+    std::fill(tileMin, tileMin + tilesX * tilesY, -std::numeric_limits<float>::max());
+    std::fill(tileMax, tileMax + tilesX * tilesY, -std::numeric_limits<float>::max());
+    if (gbufferId)
+        std::fill(gbufferId, gbufferId + n, -1);
 }
@@ -1,21 +1,113 @@
 #ifndef __RENDER_H__
 #define __RENDER_H__
 
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+#include <vector>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "kernels.h"
+#include "model.h"
 
-extern Matrix ModelView;
-extern Matrix Projection;
-extern Matrix Viewport;
+// 一次渲染的相机, 变换和场景 uniform. 每个 Render 持有自己的一份,
+// 不同线程中的 Render 互不影响
+struct RenderContext
+{
+    Matrix ModelView;
+    Matrix Projection;
+    Matrix Viewport;
+    Vec3f light = Vec3f(1, 1, 1); // 世界空间中的平行光方向(指向光源)
+
+    void getView(Vec3f pos, Vec3f center, Vec3f up);
+    void getProjection(float near, float far, float fov, float aspect);
+    void getViewport(int width, int height);
+};
+
+// 一次着色的像素包, bar 按 SoA 存放每个通道透视校正后的重心坐标
+struct FragmentPacket
+{
+    int x, y; // 通道 0 的像素坐标
+    int mask; // 需要着色的通道
+    float bar[3][PACKET_SIZE];
+    // 两个 2x2 子块(通道 {0,1,4,5} 和 {2,3,6,7})中重心坐标在屏幕 x, y 方向上相邻像素之间的差,
+    // 纹理坐标等 varying 的导数是它们的线性组合, 用于选择 mip 层级
+    float dbdx[2][3], dbdy[2][3];
+};
+
+// 由整个包(包括没有覆盖的通道)像素中心的重心坐标求出每个子块的导数
+inline void quadDerivatives(const float bar[3][PACKET_SIZE], FragmentPacket &packet)
+{
+    for (int q = 0; q < 2; q++)
+        for (int k = 0; k < 3; k++)
+        {
+            packet.dbdx[q][k] = bar[k][q * 2 + 1] - bar[k][q * 2];
+            packet.dbdy[q][k] = bar[k][q * 2 + PACKET_WIDTH] - bar[k][q * 2];
+        }
+}
+
+// 顶点阶段的输出, 按 SoA 存放每个唯一顶点的裁剪坐标和 varying
+struct VertexBuffer
+{
+    int nverts;
+    int nvaryings;
+    std::vector<float> position[4]; // 裁剪坐标 x, y, z, w
+    std::vector<std::vector<float>> varyings; // 第 k 个分量的所有顶点连续存放
+
+    Vec4f clip(int ivert) const
+    {
+        Vec4f v;
+        for (int i = 0; i < 4; i++)
+            v[i] = position[i][ivert];
+        return v;
+    }
+    float varying(int ivert, int k) const { return varyings[k][ivert]; }
+};
 
-void getView(Vec3f pos, Vec3f center, Vec3f up);
-void getProjection(float near, float far, float fov, float aspect);
-void getViewport(int width, int height);
 struct IShader
 {
+    Model *model = nullptr; // 当前绘制的模型, 由 Render::draw 设置
+    const RenderContext *context = nullptr; // 所属 Render 的相机和变换, 由 Render::draw 设置
+
     virtual ~IShader();
-    virtual Vec4f vertex(int iface, int nthvert) = 0;
+    // 每个工作线程光栅化时使用自己的拷贝
+    virtual IShader *clone() const = 0;
+    // 每个顶点输出的 varying 分量个数
+    virtual int nvaryings() = 0;
+    // 每次绘制调用一次, 计算 uniform
+    virtual void uniform() {}
+    // 对每个唯一顶点调用一次, 可能在多个线程中并发执行, 不能修改着色器的状态
+    virtual Vec4f vertex(int ivert, float *varying) = 0;
+    // 每个三角形的常量个数
+    virtual int nconstants() { return 0; }
+    // 三角形建立: 每个通过剔除的三角形调用一次, 把切线空间, 导数, 平面方程等逐三角形的常量
+    // 写入 constants, 供片元阶段读取. 同 vertex 一样不能修改着色器的状态
+    virtual void setup(const VertexBuffer &vb, const int idx[3], float *constants) {}
+    // 光栅化一个三角形之前, 读入三个顶点的 varying 和 setup 算好的常量
+    virtual void assemble(const VertexBuffer &vb, const int idx[3], const float *constants) = 0;
     virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
+    // 批量着色 packet.mask 中的通道, 返回未被丢弃的通道; 默认逐通道调用上面的标量接口
+    virtual int fragment(const FragmentPacket &packet, TGAColor colors[PACKET_SIZE]);
+};
+
+// 着色器调用: S 为具体类型时按限定名调用, 绕过虚函数表, 编译器可以把着色器内联进光栅化循环.
+// S 自己(或基类)必须提供包接口的 fragment, 否则会被同名的标量接口隐藏
+template <class S>
+struct ShaderCall
+{
+    static Vec4f vertex(IShader *s, int ivert, float *varying) { return static_cast<S *>(s)->S::vertex(ivert, varying); }
+    static void assemble(IShader *s, const VertexBuffer &vb, const int idx[3], const float *constants) { static_cast<S *>(s)->S::assemble(vb, idx, constants); }
+    static int fragment(IShader *s, const FragmentPacket &packet, TGAColor colors[PACKET_SIZE]) { return static_cast<S *>(s)->S::fragment(packet, colors); }
+};
+
+// 虚函数路径, 用于编译期不知道具体类型的着色器(比如插件)
+template <>
+struct ShaderCall<IShader>
+{
+    static Vec4f vertex(IShader *s, int ivert, float *varying) { return s->vertex(ivert, varying); }
+    static void assemble(IShader *s, const VertexBuffer &vb, const int idx[3], const float *constants) { s->assemble(vb, idx, constants); }
+    static int fragment(IShader *s, const FragmentPacket &packet, TGAColor colors[PACKET_SIZE]) { return s->fragment(packet, colors); }
 };
 
 enum MSAA
@@ -24,29 +116,374 @@ enum MSAA
     TWO_TWO
 };
 
+const int TILE_SIZE = 32;   // 屏幕分块大小(像素)
+const int RASTER_BLOCK = 8; // 光栅化时整块剔除的粒度(像素)
+const int SUBPIXEL_BITS = 8;
+const int SUBPIXEL_SCALE = 1 << SUBPIXEL_BITS;
+const float MAX_SCREEN_COORD = 1 << 22; // 超出该范围的顶点无法用定点数表示
+
+struct BinnedTriangle
+{
+    long long a[3], b[3], c[3]; // 定点边方程, 三角形内部 a * x + b * y + c >= 0
+    float r[3]; // invArea / w, 边值乘以它得到透视校正前的重心坐标
+    float z[3]; // 各顶点的深度
+    float zmin, zmax;
+    Vec2i bboxmin, bboxmax;
+    int draw;   // 所属的绘制调用
+    int idx[3]; // 顶点在顶点缓冲中的索引
+    int setup;  // 逐三角形常量在 DrawCall::constants 中的偏移
+    int gid;    // 延迟着色时在 G-buffer 三角形表中的编号
+};
+
+// 延迟着色时 G-buffer 中三角形 id 指向的条目, 着色阶段据此重新装配顶点
+struct GTriangle
+{
+    int draw;
+    int idx[3];
+    int setup;
+};
+
+class Render;
+struct CullStats;
+
+// 一次绘制调用: 着色器状态和顶点阶段的结果, 保留到帧结束
+struct DrawCall
+{
+    IShader *shader;
+    // 按着色器类型和采样数特化的光栅化函数
+    void (Render::*raster)(BinnedTriangle &t, IShader *shader, int tile, CullStats &cull);
+    VertexBuffer vb; // 裁剪产生的新顶点追加在末尾
+    int lod;                   // 使用的细节层次
+    std::vector<int> clusters; // 通过簇剔除的 meshlet, 按顺序提交其中的三角形
+    int nconstants;
+    std::vector<float> constants; // 三角形建立阶段的输出, 每个三角形 nconstants 个
+    float sign;      // 相机前方的点 w 的符号
+};
+
+// 剔除和裁剪的计数
+struct CullStats
+{
+    long long triangles;  // 装箱时整个三角形被遮挡
+    long long tiles;      // 三角形在某个 tile 内被遮挡
+    long long blocks;     // 8x8 块被遮挡
+    long long backfaces;  // 背面
+    long long degenerate; // 面积为 0
+    long long frustum;    // 完全在视锥外
+    long long clipped;    // 被近平面或保护带裁剪
+    long long clusters;         // 提交的 meshlet
+    long long clusterFrustum;   // 整簇在视锥外
+    long long clusterBackfaces; // 整簇背面朝向相机
+    long long clusterOccluded;  // 整簇被 tile 的最远深度挡住
+    long long clusterTriangles; // 被整簇剔除的三角形
+    long long lodTriangles;     // 选用较粗的 LOD 少提交的三角形
+};
+
 class Render
 {
 private:
     int width;
     int height;
     IShader *shader;
+    RenderContext context;
     TGAImage *image;
-    float *zbuffer;
     MSAA msaa;
     TGAImage *superImage;
     float *superZbuffer;
+    int tilesX, tilesY;
+    int blocksX, blocksY;
+    // 深度金字塔: 每个 8x8 块和每个 tile 中所有采样的最小/最大深度(越大越近)
+    float *blockMin, *blockMax;
+    float *tileMin, *tileMax;
+    CullStats stats;
+    bool cullBack;
+    bool clusterCull;
+    float lodThreshold; // LOD 误差投影到屏幕上允许的像素数, 0 表示总是用原网格
+    std::vector<int> activeVertices; // 通过簇剔除的 meshlet 引用的顶点, 只对它们执行顶点阶段
+    std::vector<char> vertexUsed;
+    float guardBand; // 保护带在 NDC 中的半宽
+    int packetOffset[PACKET_SIZE]; // 像素包各通道在采样缓冲中相对通道 0 的偏移
+    std::vector<DrawCall> draws;
+    std::vector<BinnedTriangle> triangles;
+    std::vector<std::vector<int>> bins; // 每个 tile 中按提交顺序排列的三角形
+    // 延迟着色的 G-buffer: 每个采样可见三角形的 id 和着色点的重心坐标, 深度复用 superZbuffer
+    bool deferred;
+    int *gbufferId;
+    float *gbufferBar;
+    std::vector<GTriangle> gTriangles;
+
+    void triangle(int draw, int i0, int i1, int i2);
+    void bin(int draw, const int idx[3]);
+    DrawCall &beginDraw(Model *model);
+    int selectLod(Model *model);
+    void cullClusters(DrawCall &d, Model *model);
+    bool sphereOccluded(const Matrix &M, float sign, Vec3f center, float radius);
+    void endDraw();
+    template <class S, int Samples>
+    void rasterize(BinnedTriangle &t, IShader *shader, int tile, CullStats &cull);
+    template <int Samples>
+    int superIndex(int x, int y, int sample) const { return (y * width + x) * Samples + sample; }
+    void updateBlock(int bx, int by);
+    void updateTile(int tile);
+    void shade();
 
 public:
     Render(int width, int height, IShader *shader, MSAA msaa);
     ~Render();
-    void triangle(mat<4, 3, float> &clipc);
+    // 着色器类型在编译期确定的绘制, 构造时传入的着色器必须是 S 类型
+    template <class S>
+    void draw(Model *model);
+    void draw(Model *model) { draw<IShader>(model); }
+    void setCullBack(bool enable) { cullBack = enable; }
+    // 在顶点阶段之前按 meshlet 整簇剔除, 要求着色器按 Projection * ModelView 变换模型坐标
+    void setClusterCull(bool enable) { clusterCull = enable; }
+    // 选择误差投影到屏幕后不超过 pixels 个像素的最粗的 LOD, 默认 1; 0 关闭 LOD
+    void setLodThreshold(float pixels) { lodThreshold = pixels; }
+    // 延迟着色: 光栅化只写 G-buffer, resolve 时每个可见像素的每个三角形只着色一次.
+    // 可见性在着色前就已确定, 片元着色器丢弃的采样不会露出后面的三角形
+    void setDeferred(bool enable);
+    void flush();
+    void resolve();
+    // 解析到外部的图像中, 尺寸和格式须与 getImage() 相同
+    void resolve(TGAImage *target);
+    // 清空采样缓冲和深度, 同一个 Render 用于下一帧; 剔除计数继续累计
+    void clear();
     int getWidth();
     int getHeight();
     int getIndex(int x, int y) { return y * width + x; }
-    int getSuperIndex(int x, int y) { return y * width * msaa + x; }
+    int getSuperIndex(int x, int y, int sample) { return (y * width + x) * msaa * msaa + sample; }
 
+    // 相机和变换, 在 draw 之前设置; 视口在构造时按图像尺寸设好
+    RenderContext &getContext() { return context; }
     TGAImage *getImage() { return image; }
     TGAImage *getSuperImage() { return superImage; }
+    const CullStats &getCullStats() { return stats; }
 };
 
+// 模板实现放在头文件中, 具体的着色器类型由使用者决定
+
+template <class S>
+void Render::draw(Model *model)
+{
+    if (!std::is_same<S, IShader>::value && !dynamic_cast<S *>(shader))
+    {
+        std::cerr << "shader type mismatch, falling back to virtual dispatch" << std::endl;
+        draw<IShader>(model);
+        return;
+    }
+    DrawCall &d = beginDraw(model);
+    d.raster = msaa == MSAA::TWO_TWO ? &Render::rasterize<S, 4> : &Render::rasterize<S, 1>;
+
+    // 顶点阶段: 可见的簇引用的每个唯一顶点只变换一次
+    VertexBuffer &vb = d.vb;
+    IShader *vs = d.shader;
+    const std::vector<int> &active = activeVertices;
+#pragma omp parallel
+    {
+        std::vector<float> varying(vb.nvaryings);
+#pragma omp for
+        for (int i = 0; i < (int)active.size(); i++)
+        {
+            int v = active[i];
+            Vec4f clip = ShaderCall<S>::vertex(vs, v, varying.data());
+            for (int i = 0; i < 4; i++)
+                vb.position[i][v] = clip[i];
+            for (int k = 0; k < vb.nvaryings; k++)
+                vb.varyings[k][v] = varying[k];
+        }
+    }
+    endDraw();
+}
+
+template <class S, int Samples>
+void Render::rasterize(BinnedTriangle &t, IShader *shader, int tile, CullStats &cull)
+{
+    // tile 中最远的深度都比三角形最近的深度更近, 整个三角形在这个 tile 中不可见
+    if (t.zmax < tileMin[tile])
+    {
+        cull.tiles++;
+        return;
+    }
+    if (!deferred)
+        ShaderCall<S>::assemble(shader, draws[t.draw].vb, t.idx, draws[t.draw].constants.data() + t.setup);
+    const RasterKernels &kernels = rasterKernels();
+    int x0 = tile % tilesX * TILE_SIZE, y0 = tile / tilesX * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, width) - 1, y1 = std::min(y0 + TILE_SIZE, height) - 1;
+    x0 = std::max(x0, t.bboxmin.x), y0 = std::max(y0, t.bboxmin.y);
+    x1 = std::min(x1, t.bboxmax.x), y1 = std::min(y1, t.bboxmax.y);
+    // 采样数是编译期常量, 下面的采样循环可以完全展开
+    const int nsamples = Samples, grid = Samples == 4 ? 2 : 1;
+    const int npoints = nsamples + 1;
+    // 各采样点在像素内的定点偏移, 最后一项是像素中心
+    long long sx[npoints], sy[npoints];
+    for (int i = 0; i < grid; i++)
+        for (int j = 0; j < grid; j++)
+        {
+            sx[i * grid + j] = (2 * i + 1) * SUBPIXEL_SCALE / (2 * grid);
+            sy[i * grid + j] = (2 * j + 1) * SUBPIXEL_SCALE / (2 * grid);
+        }
+    sx[nsamples] = sy[nsamples] = SUBPIXEL_SCALE / 2;
+    // 包内各通道相对通道 0 的边值偏移
+    long long off[3][PACKET_SIZE];
+    float offf[3][PACKET_SIZE];
+    long long stepX[3], stepY[3];
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < PACKET_SIZE; i++)
+        {
+            off[k][i] = (t.a[k] * (i % PACKET_WIDTH) + t.b[k] * (i / PACKET_WIDTH)) * SUBPIXEL_SCALE;
+            offf[k][i] = off[k][i];
+        }
+        stepX[k] = t.a[k] * SUBPIXEL_SCALE * PACKET_WIDTH;
+        stepY[k] = t.b[k] * SUBPIXEL_SCALE * PACKET_HEIGHT;
+    }
+
+    FragmentPacket packet;
+    TGAColor colors[PACKET_SIZE];
+    float bar[npoints][3][PACKET_SIZE], depth[nsamples][PACKET_SIZE], centerDepth[PACKET_SIZE];
+    int mask[nsamples];
+    bool dirty = false;
+    // 块按 8x8 的网格对齐, 与深度金字塔的底层一一对应
+    for (int by = y0 - y0 % RASTER_BLOCK; by <= y1; by += RASTER_BLOCK)
+    {
+        for (int bx = x0 - x0 % RASTER_BLOCK; bx <= x1; bx += RASTER_BLOCK)
+        {
+            int block = by / RASTER_BLOCK * blocksX + bx / RASTER_BLOCK;
+            if (t.zmax < blockMin[block])
+            {
+                cull.blocks++;
+                continue;
+            }
+            // 块与包围盒的交集
+            int lx = std::max(bx, x0), ly = std::max(by, y0);
+            int ex = std::min(bx + RASTER_BLOCK - 1, x1), ey = std::min(by + RASTER_BLOCK - 1, y1);
+            // 块完全在某条边外侧时整块跳过
+            bool outside = false;
+            for (int k = 0; k < 3 && !outside; k++)
+            {
+                long long cx = (long long)(t.a[k] > 0 ? ex + 1 : lx) << SUBPIXEL_BITS;
+                long long cy = (long long)(t.b[k] > 0 ? ey + 1 : ly) << SUBPIXEL_BITS;
+                outside = t.a[k] * cx + t.b[k] * cy + t.c[k] < 0;
+            }
+            if (outside)
+                continue;
+            // 块中最近的深度也比三角形远, 被覆盖的采样一定通过深度测试
+            bool accept = t.zmin > blockMax[block];
+            bool written = false;
+
+            long long row[npoints][3];
+            for (int s = 0; s < npoints; s++)
+                for (int k = 0; k < 3; k++)
+                    row[s][k] = t.a[k] * (((long long)bx << SUBPIXEL_BITS) + sx[s]) + t.b[k] * (((long long)by << SUBPIXEL_BITS) + sy[s]) + t.c[k];
+            for (int py = by; py <= ey; py += PACKET_HEIGHT)
+            {
+                long long e[npoints][3];
+                for (int s = 0; s < npoints; s++)
+                    for (int k = 0; k < 3; k++)
+                        e[s][k] = row[s][k];
+                for (int px = bx; px <= ex; px += PACKET_WIDTH)
+                {
+                    // 落在区域外的通道不参与
+                    int valid = 0;
+                    for (int i = 0; i < PACKET_SIZE; i++)
+                    {
+                        int x = px + i % PACKET_WIDTH, y = py + i / PACKET_WIDTH;
+                        if (x >= lx && x <= ex && y >= ly && y <= ey)
+                            valid |= 1 << i;
+                    }
+                    // 逐采样点做覆盖和深度测试
+                    int any = 0;
+                    for (int s = 0; s < nsamples; s++)
+                    {
+                        mask[s] = kernels.coverage(e[s], off) & valid;
+                        if (!mask[s])
+                            continue;
+                        float ef[3] = {float(e[s][0]), float(e[s][1]), float(e[s][2])};
+                        kernels.interpolate(ef, offf, t.r, t.z, bar[s], depth[s]);
+                        if (!accept)
+                            mask[s] = kernels.depthTest(superZbuffer + superIndex<Samples>(px, py, s), packetOffset, depth[s], mask[s]);
+                        any |= mask[s];
+                    }
+                    if (any)
+                    {
+                        // 每个像素只着色一次: 像素中心在三角形内时在中心着色, 否则取第一个通过的采样点
+                        // 像素中心的重心坐标总是整包求出, 没有覆盖的通道外推, 用来求导数
+                        int center = 0;
+                        if (nsamples > 1)
+                        {
+                            center = kernels.coverage(e[nsamples], off) & any;
+                            float ef[3] = {float(e[nsamples][0]), float(e[nsamples][1]), float(e[nsamples][2])};
+                            kernels.interpolate(ef, offf, t.r, t.z, bar[nsamples], centerDepth);
+                        }
+                        quadDerivatives(bar[nsamples > 1 ? nsamples : 0], packet);
+                        packet.x = px, packet.y = py, packet.mask = any;
+                        for (int i = 0; i < PACKET_SIZE; i++)
+                        {
+                            if (!(any >> i & 1))
+                                continue;
+                            int s = nsamples;
+                            if (!(center >> i & 1))
+                                for (s = 0; !(mask[s] >> i & 1); s++)
+                                    ;
+                            for (int k = 0; k < 3; k++)
+                                packet.bar[k][i] = bar[s][k][i];
+                        }
+                        if (deferred)
+                        {
+                            // 几何阶段只记录可见性, 着色推迟到 resolve
+                            for (int i = 0; i < PACKET_SIZE; i++)
+                            {
+                                if (!(any >> i & 1))
+                                    continue;
+                                int idx = superIndex<Samples>(px + i % PACKET_WIDTH, py + i / PACKET_WIDTH, 0);
+                                for (int s = 0; s < nsamples; s++)
+                                {
+                                    if (!(mask[s] >> i & 1))
+                                        continue;
+                                    superZbuffer[idx + s] = depth[s][i];
+                                    gbufferId[idx + s] = t.gid;
+                                    for (int k = 0; k < 3; k++)
+                                        gbufferBar[(idx + s) * 3 + k] = packet.bar[k][i];
+                                }
+                            }
+                            written = true;
+                        }
+                        else
+                        {
+                            int kept = ShaderCall<S>::fragment(shader, packet, colors);
+                            written |= kept != 0;
+                            for (int i = 0; i < PACKET_SIZE; i++)
+                            {
+                                if (!(kept >> i & 1))
+                                    continue;
+                                int x = px + i % PACKET_WIDTH, y = py + i / PACKET_WIDTH;
+                                int idx = superIndex<Samples>(x, y, 0);
+                                for (int s = 0; s < nsamples; s++)
+                                {
+                                    if (!(mask[s] >> i & 1))
+                                        continue;
+                                    superZbuffer[idx + s] = depth[s][i];
+                                    superImage->set(x * nsamples + s, y, colors[i]);
+                                }
+                            }
+                        }
+                    }
+                    for (int s = 0; s < npoints; s++)
+                        for (int k = 0; k < 3; k++)
+                            e[s][k] += stepX[k];
+                }
+                for (int s = 0; s < npoints; s++)
+                    for (int k = 0; k < 3; k++)
+                        row[s][k] += stepY[k];
+            }
+            if (written)
+            {
+                updateBlock(bx / RASTER_BLOCK, by / RASTER_BLOCK);
+                dirty = true;
+            }
+        }
+    }
+    if (dirty)
+        updateTile(tile);
+}
+
 #endif
\ No newline at end of file
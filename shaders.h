@@ -0,0 +1,177 @@
+#ifndef __SHADERS_H__
+#define __SHADERS_H__
+
+#include <algorithm>
+#include <cmath>
+#include "geometry.h"
+#include "model.h"
+#include "render.h"
+
+// 主程序和渲染服务共用的着色器, 模型和相机都来自 IShader 的 model 和 context
+
+// 两个着色器共用的顶点阶段: 输出纹理坐标和变换后的法线
+struct ModelShader : public IShader
+{
+    Matrix uniform_M;   // Projection * ModelView
+    Matrix uniform_MIT; // 法线变换矩阵
+    mat<2, 3, float> varying_uv;
+    mat<3, 3, float> varying_nrm;
+    mat<3, 3, float> ndc_tri;
+    Vec3f tri_t, tri_b, tri_n; // 三角形平面内的切线和副切线特解, 面法线
+    Vec3f uniform_light;       // 变换到裁剪空间后的光照方向
+
+    virtual int nvaryings() { return 5; }
+    virtual int nconstants() { return 9; }
+
+    virtual void uniform()
+    {
+        uniform_M = context->Projection * context->ModelView;
+        uniform_MIT = uniform_M.invert_transpose();
+        uniform_light = proj<3>(uniform_MIT * embed<4>(context->light, 0.f)).normalize();
+    }
+
+    virtual Vec4f vertex(int ivert, float *varying)
+    {
+        Vec2f uv = model->uv(ivert);
+        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(ivert), 0.f));
+        varying[0] = uv.x, varying[1] = uv.y;
+        varying[2] = n.x, varying[3] = n.y, varying[4] = n.z;
+        return uniform_M * embed<4>(model->vert(ivert));
+    }
+
+    // 切线 i 满足 e1 * i = du1, e2 * i = du2, n * i = 0 (副切线 j 同理).
+    // 前两个条件只和三角形有关: 先在三角形平面内求出特解 t, 通解为 t + s * fn,
+    // 片元阶段再由第三个条件定出 s = -(n * t) / (n * fn), 不需要逐片元求逆矩阵
+    virtual void setup(const VertexBuffer &vb, const int idx[3], float *constants)
+    {
+        Vec3f p[3];
+        Vec2f uv[3];
+        for (int k = 0; k < 3; k++)
+        {
+            Vec4f gl_Vertex = vb.clip(idx[k]);
+            p[k] = proj<3>(gl_Vertex / gl_Vertex[3]);
+            uv[k] = Vec2f(vb.varying(idx[k], 0), vb.varying(idx[k], 1));
+        }
+        Vec3f e1 = p[1] - p[0], e2 = p[2] - p[0];
+        float a = e1 * e1, b = e1 * e2, c = e2 * e2, det = a * c - b * b;
+        Vec3f t(0, 0, 0), bt(0, 0, 0);
+        if (det != 0)
+        {
+            Vec2f d1 = uv[1] - uv[0], d2 = uv[2] - uv[0];
+            t = e1 * ((c * d1.x - b * d2.x) / det) + e2 * ((a * d2.x - b * d1.x) / det);
+            bt = e1 * ((c * d1.y - b * d2.y) / det) + e2 * ((a * d2.y - b * d1.y) / det);
+        }
+        Vec3f fn = cross(e1, e2);
+        for (int i = 0; i < 3; i++)
+        {
+            constants[i] = t[i];
+            constants[3 + i] = bt[i];
+            constants[6 + i] = fn[i];
+        }
+    }
+
+    virtual void assemble(const VertexBuffer &vb, const int idx[3], const float *constants)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            varying_uv.set_col(k, Vec2f(vb.varying(idx[k], 0), vb.varying(idx[k], 1)));
+            varying_nrm.set_col(k, Vec3f(vb.varying(idx[k], 2), vb.varying(idx[k], 3), vb.varying(idx[k], 4)));
+            Vec4f gl_Vertex = vb.clip(idx[k]);
+            ndc_tri.set_col(k, proj<3>(gl_Vertex / gl_Vertex[3]));
+        }
+        tri_t = Vec3f(constants[0], constants[1], constants[2]);
+        tri_b = Vec3f(constants[3], constants[4], constants[5]);
+        tri_n = Vec3f(constants[6], constants[7], constants[8]);
+    }
+
+    // 以 normal 为法线的切线空间
+    mat<3, 3, float> tbn(Vec3f normal)
+    {
+        float k = 1.f / (normal * tri_n);
+        Vec3f i = tri_t - tri_n * ((normal * tri_t) * k);
+        Vec3f j = tri_b - tri_n * ((normal * tri_b) * k);
+        mat<3, 3, float> B;
+        B.set_col(0, i.normalize());
+        B.set_col(1, j.normalize());
+        B.set_col(2, normal);
+        return B;
+    }
+};
+
+struct Shader : public ModelShader
+{
+    virtual IShader *clone() const { return new Shader(*this); }
+    // 包接口用默认的逐通道实现
+    using IShader::fragment;
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+
+        float ka = 0.1, kd = 0.9, ks = 0.3, p = 60;
+        TGAColor amb = {128, 128, 128, 255};
+
+        Vec3f bn = (varying_nrm * bar).normalize();
+        Vec2f uv = varying_uv * bar;
+        Vec3f vtx = ndc_tri * bar;
+        Vec3f n = (tbn(bn) * model->normal(uv)).normalize();
+
+        float diff = std::max(0.f, n * uniform_light);
+
+        // 计算高光
+        Vec3f eyeDir = -vtx;
+        Vec3f half = (uniform_light + eyeDir).normalize();
+        float spec = std::max(0.f, half * bn);
+
+        color = amb * ka + model->diff(uv) * diff * kd + model->spec(uv) * std::pow(spec, p) * ks;
+
+        return false;
+    }
+};
+struct PhongShader : public ModelShader
+{
+    virtual IShader *clone() const { return new PhongShader(*this); }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        // 单个像素没有导数信息, 在纹理第 0 层上采样
+        color = shade(varying_nrm * bar, varying_uv * bar, Vec2f(0, 0), Vec2f(0, 0));
+        return false;
+    }
+
+    virtual int fragment(const FragmentPacket &packet, TGAColor colors[PACKET_SIZE])
+    {
+        // 整包按 SoA 插值法线和纹理坐标, 这部分循环可以被编译器向量化
+        float nrm[3][PACKET_SIZE], uv[2][PACKET_SIZE];
+        for (int r = 0; r < 3; r++)
+            for (int i = 0; i < PACKET_SIZE; i++)
+                nrm[r][i] = varying_nrm[r][2] * packet.bar[2][i] + varying_nrm[r][1] * packet.bar[1][i] + varying_nrm[r][0] * packet.bar[0][i];
+        for (int r = 0; r < 2; r++)
+            for (int i = 0; i < PACKET_SIZE; i++)
+                uv[r][i] = varying_uv[r][2] * packet.bar[2][i] + varying_uv[r][1] * packet.bar[1][i] + varying_uv[r][0] * packet.bar[0][i];
+        // 每个 2x2 子块共用一组纹理坐标导数
+        Vec2f dx[2], dy[2];
+        for (int q = 0; q < 2; q++)
+            for (int r = 0; r < 2; r++)
+            {
+                dx[q][r] = varying_uv[r][0] * packet.dbdx[q][0] + varying_uv[r][1] * packet.dbdx[q][1] + varying_uv[r][2] * packet.dbdx[q][2];
+                dy[q][r] = varying_uv[r][0] * packet.dbdy[q][0] + varying_uv[r][1] * packet.dbdy[q][1] + varying_uv[r][2] * packet.dbdy[q][2];
+            }
+        for (int i = 0; i < PACKET_SIZE; i++)
+        {
+            int q = i % PACKET_WIDTH / 2;
+            if (packet.mask >> i & 1)
+                colors[i] = shade(Vec3f(nrm[0][i], nrm[1][i], nrm[2][i]), Vec2f(uv[0][i], uv[1][i]), dx[q], dy[q]);
+        }
+        return packet.mask;
+    }
+
+    TGAColor shade(Vec3f normal, Vec2f uv, Vec2f dx, Vec2f dy)
+    {
+        Vec3f n = (tbn(normal) * model->normal(uv, dx, dy)).normalize();
+        float intensity = n * uniform_light;
+
+        return model->diff(uv, dx, dy) * intensity;
+    }
+};
+
+#endif
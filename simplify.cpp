@@ -0,0 +1,307 @@
+#include "simplify.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+#include "meshlet.h"
+
+namespace
+{
+    const float SEAM_WEIGHT = 10.f; // 接缝边约束平面的权重, 相对于面的面积
+
+    enum VertexKind
+    {
+        MANIFOLD, // 只有一份顶点, 可以并到任何相邻顶点
+        SEAM,     // 接缝两侧各一份, 只能沿接缝折叠
+        LOCKED    // 边界, 非流形或者更复杂的拆分, 不移动
+    };
+
+    // 对称 4x4 矩阵的上三角, 加上累计的面积用于把误差换算成距离
+    struct Quadric
+    {
+        double a[10];
+        double weight;
+
+        void addPlane(Vec3f n, float d, double w)
+        {
+            double p[4] = {n.x, n.y, n.z, d};
+            int k = 0;
+            for (int i = 0; i < 4; i++)
+                for (int j = i; j < 4; j++)
+                    a[k++] += w * p[i] * p[j];
+        }
+        void add(const Quadric &q)
+        {
+            for (int k = 0; k < 10; k++)
+                a[k] += q.a[k];
+            weight += q.weight;
+        }
+        double eval(Vec3f v) const
+        {
+            double x = v.x, y = v.y, z = v.z;
+            return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+                 + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+                 + a[7] * z * z + 2 * a[8] * z + a[9];
+        }
+    };
+
+    struct EdgeInfo
+    {
+        int count;  // 相邻的三角形数
+        uint32_t a, b; // 第一次遇到时两端的顶点
+        bool seam;  // 两侧三角形引用的顶点不同
+    };
+
+    struct Collapse
+    {
+        int from, to; // 合并后的顶点编号
+        float cost;
+    };
+
+    uint64_t edgeKey(int a, int b)
+    {
+        return a < b ? (uint64_t)a << 32 | (uint32_t)b : (uint64_t)b << 32 | (uint32_t)a;
+    }
+}
+
+void simplifyMesh(const MeshView &mesh, std::vector<LodLevel> &lods)
+{
+    lods.clear();
+    if (mesh.nfaces == 0 || mesh.nindices != mesh.nfaces * 3)
+        return;
+    int nverts = mesh.nverts;
+    std::vector<uint32_t> tris(mesh.indices, mesh.indices + mesh.nindices);
+    // 折叠在合并后的顶点(下面称为点)之间进行, 每个点的各份顶点一起移动
+    std::vector<int> group = weldPositions(mesh);
+    std::vector<Vec3f> pos(nverts);
+    for (int v = 0; v < nverts; v++)
+        pos[v] = mesh.vertices[v].position;
+    // 每个点被引用的顶点份数
+    std::vector<int> copies(nverts, 0);
+    {
+        std::vector<char> referenced(nverts, 0);
+        for (uint32_t v : tris)
+            if (!referenced[v])
+                referenced[v] = 1, copies[group[v]]++;
+    }
+
+    // 边的分类: 边界和非流形边的端点锁定, 两侧引用不同顶点的是接缝
+    std::unordered_map<uint64_t, EdgeInfo> edges;
+    edges.reserve(tris.size());
+    for (size_t i = 0; i < tris.size(); i++)
+    {
+        uint32_t a = tris[i], b = tris[i % 3 == 2 ? i - 2 : i + 1];
+        if (group[a] > group[b])
+            std::swap(a, b);
+        auto [it, inserted] = edges.try_emplace(edgeKey(group[a], group[b]), EdgeInfo{0, a, b, false});
+        it->second.count++;
+        if (!inserted && (it->second.a != a || it->second.b != b))
+            it->second.seam = true;
+    }
+    std::vector<char> kind(nverts, LOCKED);
+    for (int g = 0; g < nverts; g++)
+        if (copies[g] == 1 || copies[g] == 2)
+            kind[g] = copies[g] == 1 ? MANIFOLD : SEAM;
+    for (auto &[key, e] : edges)
+        if (e.count != 2)
+            kind[key >> 32] = kind[(uint32_t)key] = LOCKED;
+
+    // 每个点的二次误差: 相邻面的平面按面积加权, 接缝边再加上垂直于面的约束平面, 接缝的形状尽量不变
+    std::vector<Quadric> quadrics(nverts, Quadric{});
+    for (size_t t = 0; t < tris.size(); t += 3)
+    {
+        Vec3f p[3] = {pos[tris[t]], pos[tris[t + 1]], pos[tris[t + 2]]};
+        Vec3f n = cross(p[1] - p[0], p[2] - p[0]);
+        float len = n.norm();
+        if (len == 0)
+            continue;
+        n = n / len;
+        float area = len / 2;
+        for (int k = 0; k < 3; k++)
+        {
+            Quadric &q = quadrics[group[tris[t + k]]];
+            q.addPlane(n, -(n * p[0]), area);
+            q.weight += area;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            int ga = group[tris[t + k]], gb = group[tris[t + (k + 1) % 3]];
+            if (!edges[edgeKey(ga, gb)].seam)
+                continue;
+            Vec3f dir = p[(k + 1) % 3] - p[k];
+            Vec3f en = cross(dir, n);
+            float elen = en.norm();
+            if (elen == 0)
+                continue;
+            en = en / elen;
+            float w = (dir * dir) * SEAM_WEIGHT;
+            quadrics[ga].addPlane(en, -(en * p[k]), w);
+            quadrics[gb].addPlane(en, -(en * p[k]), w);
+        }
+    }
+
+    std::vector<uint32_t> remap(nverts);
+    std::iota(remap.begin(), remap.end(), 0);
+    std::vector<int> fanStart(nverts + 1), fan;
+    std::vector<char> touched(nverts);
+    std::vector<Collapse> collapses;
+    std::vector<std::pair<uint32_t, uint32_t>> copyMap; // 折叠时每份顶点的去向
+    float error = 0;
+    bool unlimited = false;
+    size_t target = tris.size() / 3 / 2;
+    while ((int)lods.size() < LOD_MAX_LEVELS)
+    {
+        size_t ntris = tris.size() / 3;
+        if (ntris <= target)
+        {
+            lods.push_back({tris, error});
+            if (ntris < LOD_MIN_TRIANGLES)
+                break;
+            target = ntris / 2;
+            continue;
+        }
+
+        // 每一轮按当前的三角形建立点到三角形的邻接, 按代价从小到大折叠互不相邻的边
+        std::fill(fanStart.begin(), fanStart.end(), 0);
+        for (uint32_t v : tris)
+            fanStart[group[v] + 1]++;
+        std::partial_sum(fanStart.begin(), fanStart.end(), fanStart.begin());
+        fan.resize(tris.size());
+        {
+            std::vector<int> fill(fanStart.begin(), fanStart.end() - 1);
+            for (size_t i = 0; i < tris.size(); i++)
+                fan[fill[group[tris[i]]]++] = i / 3;
+        }
+
+        // 把 from 并到 to 时 from 的每份顶点的去向: 取与它共边的 to 的那份, 必须唯一.
+        // 没有与 to 共边的那份无处可去, 不能折叠
+        auto mapCopies = [&](int from, int to) {
+            copyMap.clear();
+            for (int i = fanStart[from]; i < fanStart[from + 1]; i++)
+            {
+                const uint32_t *t = &tris[fan[i] * 3];
+                uint32_t a = 0, b = UINT32_MAX;
+                for (int k = 0; k < 3; k++)
+                {
+                    if (group[t[k]] == from)
+                        a = t[k];
+                    if (group[t[k]] == to)
+                        b = t[k];
+                }
+                auto it = std::find_if(copyMap.begin(), copyMap.end(), [&](auto &m) { return m.first == a; });
+                if (it == copyMap.end())
+                    copyMap.push_back({a, b});
+                else if (it->second == UINT32_MAX)
+                    it->second = b;
+                else if (b != UINT32_MAX && it->second != b)
+                    return false;
+            }
+            for (auto &m : copyMap)
+                if (m.second == UINT32_MAX)
+                    return false;
+            // 接缝两侧必须分别并到 to 的两份顶点上
+            return copyMap.size() < 2 || copyMap[0].second != copyMap[1].second;
+        };
+
+        // 流形上每条边在两个三角形中方向相反地各出现一次, 只取一次, 两个方向中取代价小的
+        collapses.clear();
+        for (size_t i = 0; i < tris.size(); i++)
+        {
+            int a = group[tris[i]], b = group[tris[i % 3 == 2 ? i - 2 : i + 1]];
+            if (a > b)
+                continue;
+            Quadric q = quadrics[a];
+            q.add(quadrics[b]);
+            double w = std::max(q.weight, 1e-12);
+            Collapse best = {-1, -1, std::numeric_limits<float>::max()};
+            for (int dir = 0; dir < 2; dir++, std::swap(a, b))
+            {
+                if (kind[a] == LOCKED || (kind[a] == SEAM && kind[b] == MANIFOLD))
+                    continue;
+                float cost = std::max(0.0, q.eval(pos[b]) / w);
+                if (cost < best.cost)
+                    best = {a, b, cost};
+            }
+            if (best.from >= 0)
+                collapses.push_back(best);
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse &x, const Collapse &y) { return x.cost < y.cost; });
+
+        // 一轮中相邻的边不能同时折叠, 只按目标三角形数走下去会用上很贵的折叠, 而便宜的折叠只是被挡到了下一轮.
+        // 每轮的代价上限取足够达到目标的那么多条最便宜折叠中最贵的一条; 这样一条也折叠不了时再放开上限
+        size_t needed = (ntris - target) / 2 + 1;
+        float goal = unlimited || collapses.empty() ? std::numeric_limits<float>::max() : collapses[std::min(needed, collapses.size() - 1)].cost;
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t remaining = ntris;
+        int applied = 0;
+        for (const Collapse &c : collapses)
+        {
+            if (remaining <= target || c.cost > goal)
+                break;
+            if (touched[c.from] || touched[c.to] || !mapCopies(c.from, c.to))
+                continue;
+            // 移动后法线翻转的三角形不允许折叠
+            bool flipped = false;
+            int removed = 0;
+            for (int i = fanStart[c.from]; i < fanStart[c.from + 1] && !flipped; i++)
+            {
+                const uint32_t *t = &tris[fan[i] * 3];
+                Vec3f p[3], q[3];
+                bool hasTo = false;
+                for (int k = 0; k < 3; k++)
+                {
+                    p[k] = q[k] = pos[group[t[k]]];
+                    if (group[t[k]] == c.from)
+                        q[k] = pos[c.to];
+                    hasTo |= group[t[k]] == c.to;
+                }
+                if (hasTo)
+                {
+                    removed++;
+                    continue;
+                }
+                Vec3f n0 = cross(p[1] - p[0], p[2] - p[0]), n1 = cross(q[1] - q[0], q[2] - q[0]);
+                flipped = !(n0 * n1 > 0);
+            }
+            if (flipped)
+                continue;
+            for (auto &[a, b] : copyMap)
+                remap[a] = b;
+            quadrics[c.to].add(quadrics[c.from]);
+            error = std::max(error, std::sqrt(c.cost));
+            remaining -= removed;
+            applied++;
+            // 周围的点本轮不再参与, 上面的翻转检查用到的位置和邻接都保持有效
+            touched[c.from] = touched[c.to] = 1;
+            for (int i = fanStart[c.from]; i < fanStart[c.from + 1]; i++)
+                for (int k = 0; k < 3; k++)
+                    touched[group[tris[fan[i] * 3 + k]]] = 1;
+        }
+        if (applied == 0 && !unlimited)
+        {
+            unlimited = true;
+            continue;
+        }
+        unlimited = false;
+        if (applied == 0)
+        {
+            // 化简不动了, 比上一级少得足够多时剩下的作为最粗的一级
+            if (lods.empty() || ntris * 4 < lods.back().indices.size() / 3 * 3)
+                lods.push_back({tris, error});
+            break;
+        }
+
+        // 重写索引, 丢弃退化的三角形
+        size_t kept = 0;
+        for (size_t t = 0; t < tris.size(); t += 3)
+        {
+            uint32_t a = remap[tris[t]], b = remap[tris[t + 1]], c = remap[tris[t + 2]];
+            if (group[a] == group[b] || group[b] == group[c] || group[a] == group[c])
+                continue;
+            tris[kept++] = a, tris[kept++] = b, tris[kept++] = c;
+        }
+        tris.resize(kept);
+        std::iota(remap.begin(), remap.end(), 0);
+    }
+}
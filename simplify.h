@@ -0,0 +1,23 @@
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include <cstdint>
+#include <vector>
+#include "meshcache.h"
+
+const int LOD_MAX_LEVELS = 8;      // 不含原网格
+const int LOD_MIN_TRIANGLES = 64;  // 三角形少于这个数之后不再生成更粗的一级
+
+// 一级 LOD: 与原网格共用顶点缓冲, 只有三角形索引不同
+struct LodLevel
+{
+    std::vector<uint32_t> indices;
+    float error; // 相对原网格的几何误差估计(模型空间单位), 随级数单调增加
+};
+
+// 二次误差度量的边折叠简化, 生成三角形数依次减半的 LOD 链(不含原网格), 化简不动时提前结束.
+// 折叠只把顶点并到相邻的已有顶点上, 顶点缓冲不变. 纹理接缝两侧的顶点只能沿接缝成对折叠,
+// 开放边界和非流形边上的顶点不动. 要求网格已经三角化
+void simplifyMesh(const MeshView &mesh, std::vector<LodLevel> &lods);
+
+#endif
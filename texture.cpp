@@ -1,36 +1,243 @@
 #include "texture.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+TextureFilter Texture::filter = TRILINEAR;
+int Texture::maxAnisotropy = 8;
 
 Texture::Texture()
 {
-    image = new TGAImage();
+    width = height = 0;
+    bytespp = 1;
 }
 
-Texture::Texture(const char *fileName)
+Texture::Texture(const char *fileName, bool normalMap)
 {
-    image = new TGAImage();
-    image->read_tga_file(fileName);
-    width = image->get_width();
-    height = image->get_height();
+    width = height = 0;
+    bytespp = 1;
+    TGAImage image;
+    if (!image.read_tga_file(fileName))
+        return;
+    width = image.get_width();
+    height = image.get_height();
+    bytespp = image.get_bytespp();
+    // 统一转成 32 位纹素并分块存放, 同时上下翻转, 让第 y 行对应 v = y / height
+    Level base;
+    base.width = width;
+    base.height = height;
+    base.tilesX = (width + TILE_MASK) >> TILE_BITS;
+    size_t size = (size_t)base.tilesX * ((height + TILE_MASK) >> TILE_BITS) << (2 * TILE_BITS);
+    base.texels.assign(size, 0);
+    if (normalMap)
+        base.normals.assign(size * 4, 0.f);
+    const unsigned char *src = image.buffer();
+#pragma omp parallel for
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *row = src + (size_t)(height - 1 - y) * width * bytespp;
+        for (int x = 0; x < width; x++)
+        {
+            size_t o = base.offset(x, y);
+            memcpy(&base.texels[o], row + x * bytespp, bytespp);
+            if (!normalMap)
+                continue;
+            const unsigned char *c = (const unsigned char *)&base.texels[o];
+            for (int i = 0; i < 3; i++)
+                base.normals[o * 4 + i] = c[3 - i - 1] / 255.f * 2 - 1;
+        }
+    }
+    levels.push_back(std::move(base));
+    buildMipmaps();
 }
 
 Texture::~Texture()
 {
-    delete image;
 }
 
-TGAImage Texture::getImage()
+void Texture::buildMipmaps()
+{
+    // 2x2 盒式滤波逐层缩小到 1x1, 奇数尺寸时多出的一行/列只在边上参与.
+    // 法线按向量取平均, 不重新归一化, 长度变短表示这一片法线分散
+    while (levels.back().width > 1 || levels.back().height > 1)
+    {
+        const Level &src = levels.back();
+        Level dst;
+        dst.width = std::max(1, src.width / 2);
+        dst.height = std::max(1, src.height / 2);
+        dst.tilesX = (dst.width + TILE_MASK) >> TILE_BITS;
+        size_t size = (size_t)dst.tilesX * ((dst.height + TILE_MASK) >> TILE_BITS) << (2 * TILE_BITS);
+        dst.texels.assign(size, 0);
+        bool normals = !src.normals.empty();
+        if (normals)
+            dst.normals.assign(size * 4, 0.f);
+#pragma omp parallel for
+        for (int y = 0; y < dst.height; y++)
+        {
+            int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+            for (int x = 0; x < dst.width; x++)
+            {
+                int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                size_t o[4] = {src.offset(x0, y0), src.offset(x1, y0), src.offset(x0, y1), src.offset(x1, y1)};
+                size_t out = dst.offset(x, y);
+                const unsigned char *t[4];
+                for (int i = 0; i < 4; i++)
+                    t[i] = (const unsigned char *)&src.texels[o[i]];
+                unsigned char *d = (unsigned char *)&dst.texels[out];
+                for (int c = 0; c < 4; c++)
+                    d[c] = (t[0][c] + t[1][c] + t[2][c] + t[3][c] + 2) / 4;
+                if (!normals)
+                    continue;
+                for (int c = 0; c < 3; c++)
+                    dst.normals[out * 4 + c] = (src.normals[o[0] * 4 + c] + src.normals[o[1] * 4 + c] + src.normals[o[2] * 4 + c] + src.normals[o[3] * 4 + c]) * .25f;
+            }
+        }
+        levels.push_back(std::move(dst));
+    }
+}
+
+size_t Texture::bytes()
+{
+    size_t total = 0;
+    for (const Level &level : levels)
+        total += level.texels.size() * sizeof(uint32_t) + level.normals.size() * sizeof(float);
+    return total;
+}
+
+template <bool Normals>
+void Texture::bilinear(const Level &level, float u, float v, float color[4])
+{
+    // 纹素中心位于 (i + 0.5) / size, 坐标超出 [0, 1] 时重复
+    float fx = u * level.width - 0.5f, fy = v * level.height - 0.5f;
+    float x0f = std::floor(fx), y0f = std::floor(fy);
+    float tx = fx - x0f, ty = fy - y0f;
+    int x0 = wrap((int)x0f, level.width), x1 = wrap((int)x0f + 1, level.width);
+    int y0 = wrap((int)y0f, level.height), y1 = wrap((int)y0f + 1, level.height);
+    size_t o00 = level.offset(x0, y0), o10 = level.offset(x1, y0);
+    size_t o01 = level.offset(x0, y1), o11 = level.offset(x1, y1);
+    if constexpr (Normals)
+    {
+        const float *t00 = &level.normals[o00 * 4], *t10 = &level.normals[o10 * 4];
+        const float *t01 = &level.normals[o01 * 4], *t11 = &level.normals[o11 * 4];
+        for (int c = 0; c < 3; c++)
+        {
+            float top = t00[c] + (t10[c] - t00[c]) * tx;
+            float bottom = t01[c] + (t11[c] - t01[c]) * tx;
+            color[c] = top + (bottom - top) * ty;
+        }
+    }
+    else
+    {
+        const unsigned char *t00 = (const unsigned char *)&level.texels[o00];
+        const unsigned char *t10 = (const unsigned char *)&level.texels[o10];
+        const unsigned char *t01 = (const unsigned char *)&level.texels[o01];
+        const unsigned char *t11 = (const unsigned char *)&level.texels[o11];
+        for (int c = 0; c < 4; c++)
+        {
+            float top = t00[c] + (t10[c] - t00[c]) * tx;
+            float bottom = t01[c] + (t11[c] - t01[c]) * tx;
+            color[c] = top + (bottom - top) * ty;
+        }
+    }
+}
+
+template <bool Normals>
+void Texture::trilinear(float u, float v, float lod, float color[4])
+{
+    int last = levels.size() - 1;
+    lod = std::min(lod, (float)last);
+    int l0 = (int)lod;
+    float t = lod - l0;
+    bilinear<Normals>(levels[l0], u, v, color);
+    if (t > 0 && l0 < last)
+    {
+        float next[4];
+        bilinear<Normals>(levels[l0 + 1], u, v, next);
+        for (int c = 0; c < 4; c++)
+            color[c] += (next[c] - color[c]) * t;
+    }
+}
+
+template <bool Normals>
+void Texture::filtered(Vec2f uv, Vec2f dx, Vec2f dy, float color[4])
+{
+    // 屏幕上相邻像素之间在第 0 层上跨过的纹素数
+    float dux = dx.x * width, dvx = dx.y * height, duy = dy.x * width, dvy = dy.y * height;
+    float lx = std::sqrt(dux * dux + dvx * dvx), ly = std::sqrt(duy * duy + dvy * dvy);
+    for (int c = 0; c < 4; c++)
+        color[c] = 0;
+    if (filter == ANISOTROPIC)
+    {
+        // 沿主轴取 n 个样本, 每个样本只需覆盖 major / n 的范围, LOD 由此确定
+        float major = std::max(lx, ly), minor = std::min(lx, ly);
+        int n = 1;
+        if (major > 0 && std::isfinite(major))
+            n = minor > 0 ? std::min<float>(maxAnisotropy, std::ceil(major / minor)) : maxAnisotropy;
+        float lod = std::log2(major / n);
+        lod = lod >= 0 ? lod : 0;
+        Vec2f axis = lx > ly ? dx : dy;
+        for (int i = 0; i < n; i++)
+        {
+            float s = (i + 0.5f) / n - 0.5f, tap[4];
+            trilinear<Normals>(uv.x + axis.x * s, uv.y + axis.y * s, lod, tap);
+            for (int c = 0; c < 4; c++)
+                color[c] += tap[c] / n;
+        }
+    }
+    else
+    {
+        float lod = std::log2(std::max(lx, ly));
+        lod = lod >= 0 ? lod : 0; // 放大或导数无效(NaN)时用第 0 层
+        if (filter == BILINEAR)
+            bilinear<Normals>(levels[std::min<int>(std::min(lod, 1e6f) + 0.5f, levels.size() - 1)], uv.x, uv.y, color);
+        else
+            trilinear<Normals>(uv.x, uv.y, lod, color);
+    }
+}
+
+TGAColor Texture::sample(Vec2f uv, Vec2f dx, Vec2f dy)
+{
+    if (levels.empty())
+        return TGAColor();
+    if (filter == NEAREST)
+        return this->uv(uv);
+    float color[4];
+    filtered<false>(uv, dx, dy, color);
+    TGAColor res;
+    res.bytespp = bytespp;
+    for (int c = 0; c < 4; c++)
+        res.bgra[c] = (unsigned char)std::min(255.f, std::max(0.f, color[c] + 0.5f));
+    return res;
+}
+
+// 法线贴图的 RGB 对应法线的 xyz
+static Vec3f decodeNormal(TGAColor c)
+{
+    return Vec3f(c[2] / 255.f * 2 - 1, c[1] / 255.f * 2 - 1, c[0] / 255.f * 2 - 1);
+}
+
+Vec3f Texture::normal(Vec2f uv)
 {
-    return *image;
+    if (!hasNormals())
+        return decodeNormal(this->uv(uv));
+    int x = uv.x * width + .5, y = uv.y * height + .5;
+    const float *n = &levels[0].normals[levels[0].offset(wrap(x, width), wrap(y, height)) * 4];
+    return Vec3f(n[0], n[1], n[2]);
 }
 
-TGAColor Texture::uv(Vec2f _uv)
+Vec3f Texture::normal(Vec2f uv, Vec2f dx, Vec2f dy)
 {
-    float u = _uv.x, v = _uv.y;
-    return uv(u, v);
+    if (!hasNormals())
+        return decodeNormal(sample(uv, dx, dy));
+    if (filter == NEAREST)
+        return normal(uv);
+    float n[4];
+    filtered<true>(uv, dx, dy, n);
+    return Vec3f(n[0], n[1], n[2]);
 }
 
-TGAColor Texture::uv(float u, float v)
+void Texture::setFilter(TextureFilter f, int anisotropy)
 {
-    int x = u * width + .5, y = v * height + .5;
-    return image->get(x, height - y - 1);
+    filter = f;
+    maxAnisotropy = std::max(1, anisotropy);
 }
@@ -1,22 +1,106 @@
 #ifndef __TEXTURE_H__
 #define __TEXTURE_H__
 
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <vector>
 #include "tgaimage.h"
 #include "geometry.h"
+
+enum TextureFilter
+{
+    NEAREST,     // 只取第 0 层最近的纹素
+    BILINEAR,    // 在 LOD 最近的一层上做双线性
+    TRILINEAR,   // 在相邻两层之间再做线性插值
+    ANISOTROPIC  // 沿屏幕上纹理坐标变化最快的方向取多个三线性样本
+};
+
 class Texture
 {
 private:
-    TGAImage *image;
+    // 纹素按 4x4 的块存放, 一块 RGBA8 是 64 字节, 正好一条缓存行;
+    // 相邻的采样(双线性的 4 个纹素, 相邻像素)大多落在同一块中
+    static const int TILE_BITS = 2;
+    static const int TILE_MASK = (1 << TILE_BITS) - 1;
+
+    // 一层 mip, 每个纹素 32 位(BGRA), 第 0 行对应 v = 0
+    struct Level
+    {
+        int width, height;
+        int tilesX; // 每行的块数, 宽高不是 4 的倍数时最后一块有空位
+        std::vector<uint32_t> texels;
+        // 以法线贴图方式加载时, 预先解码到 [-1, 1] 的法线, 每纹素 4 个 float(最后一个不用), 分块方式同 texels
+        std::vector<float> normals;
+
+        size_t offset(int x, int y) const
+        {
+            size_t tile = (size_t)(y >> TILE_BITS) * tilesX + (x >> TILE_BITS);
+            return tile << (2 * TILE_BITS) | (y & TILE_MASK) << TILE_BITS | (x & TILE_MASK);
+        }
+    };
+    std::vector<Level> levels;
     int width, height;
+    int bytespp; // 原图的每像素字节数, 采样结果保持与原图相同的通道布局
+
+    static TextureFilter filter;
+    static int maxAnisotropy;
+
+    void buildMipmaps();
+    template <bool Normals>
+    void bilinear(const Level &level, float u, float v, float color[4]);
+    template <bool Normals>
+    void trilinear(float u, float v, float lod, float color[4]);
+    template <bool Normals>
+    void filtered(Vec2f uv, Vec2f dx, Vec2f dy, float color[4]);
+
+    // 重复寻址
+    static int wrap(int i, int n)
+    {
+        if ((unsigned)i < (unsigned)n)
+            return i;
+        i %= n;
+        return i < 0 ? i + n : i;
+    }
 
 public:
     Texture();
-    Texture(const char *fileName);
+    // normalMap: 额外保存解码后的浮点法线, 法线按向量过滤, 采样时不用再解码
+    Texture(const char *fileName, bool normalMap = false);
     ~Texture();
-    TGAImage getImage();
-    TGAColor uv(Vec2f _uv);
-    TGAColor uv(float u, float v);
+    // 图像数据(包括 mip 链)占用的字节数
+    size_t bytes();
+    int levelCount() { return levels.size(); }
+    bool hasNormals() { return !levels.empty() && !levels[0].normals.empty(); }
+
+    // 快速路径: 直接取第 level 层 (x, y) 处的纹素, 调用者保证坐标在范围内
+    uint32_t fetch(int x, int y, int level = 0) const
+    {
+        const Level &l = levels[level];
+        return l.texels[l.offset(x, y)];
+    }
+    // 没有导数信息时在第 0 层取最近的纹素
+    TGAColor uv(Vec2f _uv) { return uv(_uv.x, _uv.y); }
+    TGAColor uv(float u, float v)
+    {
+        if (levels.empty())
+            return TGAColor();
+        int x = u * width + .5, y = v * height + .5;
+        uint32_t texel = fetch(wrap(x, width), wrap(y, height));
+        TGAColor color;
+        memcpy(color.bgra, &texel, 4);
+        color.bytespp = bytespp;
+        return color;
+    }
+    // dx, dy 为纹理坐标在屏幕 x, y 方向上相邻像素之间的变化量, 用于选择 mip 层级
+    TGAColor sample(Vec2f uv, Vec2f dx, Vec2f dy);
+    // 解码后的法线, 不保证是单位向量; 不是以法线贴图方式加载时由 RGBA8 解码
+    Vec3f normal(Vec2f uv);
+    Vec3f normal(Vec2f uv, Vec2f dx, Vec2f dy);
+
+    // 所有纹理共用的过滤方式, 应在渲染开始前设置
+    static void setFilter(TextureFilter f, int anisotropy = 8);
+    static TextureFilter getFilter() { return filter; }
 };
 
 #endif
@@ -0,0 +1,100 @@
+#include "texturecache.h"
+#include <cstdlib>
+
+TextureCache::TextureCache()
+{
+    budget = (size_t)512 << 20;
+    if (const char *env = std::getenv("TINYRENDERER_TEXTURE_BUDGET"))
+        budget = (size_t)std::atoll(env) << 20;
+    stats = {};
+}
+
+TextureCache &TextureCache::instance()
+{
+    static TextureCache cache;
+    return cache;
+}
+
+std::shared_ptr<Texture> TextureCache::acquire(const std::string &path, bool normalMap)
+{
+    std::string key = normalMap ? path + "#normal" : path;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(key);
+        if (it != entries.end())
+        {
+            stats.hits++;
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second.texture;
+        }
+        stats.misses++;
+    }
+    // 读文件时不持有锁, 其它纹理的命中和加载不用等待.
+    // 加载失败的纹理同样缓存起来(采样结果为黑色), 避免反复尝试打开
+    std::shared_ptr<Texture> texture = std::make_shared<Texture>(path.c_str(), normalMap);
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        // 另一个线程同时加载了同一张图, 使用先放进缓存的那份
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return it->second.texture;
+    }
+    lru.push_front(key);
+    entries[key] = {texture, texture->bytes(), lru.begin()};
+    stats.residentBytes += texture->bytes();
+    stats.entries++;
+    evict();
+    return texture;
+}
+
+void TextureCache::evict()
+{
+    // 从最久没用的开始, 跳过仍被持有的纹理
+    for (auto it = lru.end(); stats.residentBytes > budget && it != lru.begin();)
+    {
+        --it;
+        auto entry = entries.find(*it);
+        if (entry->second.texture.use_count() > 1)
+            continue;
+        stats.residentBytes -= entry->second.bytes;
+        stats.entries--;
+        stats.evictions++;
+        entries.erase(entry);
+        it = lru.erase(it);
+    }
+}
+
+void TextureCache::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    budget = bytes;
+    evict();
+}
+
+size_t TextureCache::getBudget()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return budget;
+}
+
+TextureCacheStats TextureCache::getStats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+void TextureCache::shrink()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    evict();
+}
+
+void TextureCache::trim()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    size_t saved = budget;
+    budget = 0;
+    evict();
+    budget = saved;
+}
@@ -0,0 +1,57 @@
+#ifndef __TEXTURECACHE_H__
+#define __TEXTURECACHE_H__
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "texture.h"
+
+struct TextureCacheStats
+{
+    long long hits;
+    long long misses;
+    long long evictions;
+    size_t residentBytes;
+    int entries;
+};
+
+// 进程内共享的纹理缓存, 以路径为键. 同一张图只加载一次, 被多个模型共用;
+// 常驻内存超过上限时, 淘汰最久没有使用并且没有被任何模型持有的纹理
+class TextureCache
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<Texture> texture;
+        size_t bytes;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::mutex lock;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru; // 最近使用的在前面
+    size_t budget;
+    TextureCacheStats stats;
+
+    TextureCache();
+    void evict();
+
+public:
+    // 上限默认 512MB, 可以用环境变量 TINYRENDERER_TEXTURE_BUDGET 指定(单位 MB)
+    static TextureCache &instance();
+    // 返回路径对应的纹理, 不在缓存中时加载; 持有返回值期间纹理不会被淘汰.
+    // normalMap 为真时按法线贴图加载, 与同一路径的普通纹理分开缓存
+    std::shared_ptr<Texture> acquire(const std::string &path, bool normalMap = false);
+    void setBudget(size_t bytes);
+    size_t getBudget();
+    TextureCacheStats getStats();
+    // 淘汰到预算以内, 模型放弃持有纹理之后调用
+    void shrink();
+    // 丢弃所有没有被持有的纹理
+    void trim();
+};
+
+#endif
@@ -1,9 +1,17 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstdint>
 #include <string.h>
 #include <time.h>
 #include <math.h>
 #include "tgaimage.h"
+#include "mmapfile.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <unistd.h>
+#define TGAIMAGE_POSIX
+#endif
 
 TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {}
 
@@ -44,59 +52,95 @@ TGAImage &TGAImage::operator=(const TGAImage &img)
 }
 
 bool TGAImage::read_tga_file(const char *filename)
+{
+    // 一次映射整个文件, 之后全部在内存中解码
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    return read_tga_memory((const unsigned char *)file.data(), file.size());
+}
+
+bool TGAImage::read_tga_fd(int fd)
+{
+#ifdef TGAIMAGE_POSIX
+    std::vector<unsigned char> buf(1 << 16);
+    size_t size = 0;
+    while (true)
+    {
+        // 按倍数增长, 大文件不会反复搬动
+        if (size == buf.size())
+            buf.resize(buf.size() * 2);
+        ssize_t n = read(fd, buf.data() + size, buf.size() - size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "an error occured while reading the file descriptor\n";
+            return false;
+        }
+        if (n == 0)
+            break;
+        size += n;
+    }
+    return read_tga_memory(buf.data(), size);
+#else
+    std::cerr << "reading from a file descriptor is not supported\n";
+    return false;
+#endif
+}
+
+bool TGAImage::read_tga_memory(const unsigned char *buf, size_t size)
 {
     if (data)
         delete[] data;
     data = NULL;
-    std::ifstream in;
-    in.open(filename, std::ios::binary);
-    if (!in.is_open())
+    TGA_Header header;
+    if (!buf || size < sizeof(header))
     {
-        std::cerr << "can't open file " << filename << "\n";
-        in.close();
+        std::cerr << "an error occured while reading the header\n";
         return false;
     }
-    TGA_Header header;
-    in.read((char *)&header, sizeof(header));
-    if (!in.good())
+    memcpy(&header, buf, sizeof(header));
+    const unsigned char *p = buf + sizeof(header), *end = buf + size;
+    // 跳过图像 ID 字段
+    if ((unsigned char)header.idlength > end - p)
     {
-        in.close();
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    p += (unsigned char)header.idlength;
     width = header.width;
     height = header.height;
     bytespp = header.bitsperpixel >> 3;
     if (width <= 0 || height <= 0 || (bytespp != GRAYSCALE && bytespp != RGB && bytespp != RGBA))
     {
-        in.close();
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    unsigned long nbytes = bytespp * width * height;
+    unsigned long nbytes = (unsigned long)bytespp * width * height;
     data = new unsigned char[nbytes];
     if (3 == header.datatypecode || 2 == header.datatypecode)
     {
-        in.read((char *)data, nbytes);
-        if (!in.good())
+        if ((size_t)(end - p) < nbytes)
         {
-            in.close();
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        memcpy(data, p, nbytes);
     }
     else if (10 == header.datatypecode || 11 == header.datatypecode)
     {
-        if (!load_rle_data(in))
+        if (!load_rle_data(p, end))
         {
-            in.close();
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     }
     else
     {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
@@ -109,147 +153,165 @@ bool TGAImage::read_tga_file(const char *filename)
         flip_horizontally();
     }
     std::cerr << width << "x" << height << "/" << bytespp * 8 << "\n";
-    in.close();
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in)
+bool TGAImage::load_rle_data(const unsigned char *&p, const unsigned char *end)
 {
-    unsigned long pixelcount = width * height;
+    unsigned long pixelcount = (unsigned long)width * height;
     unsigned long currentpixel = 0;
-    unsigned long currentbyte = 0;
-    TGAColor colorbuffer;
-    do
+    unsigned char *dst = data;
+    while (currentpixel < pixelcount)
     {
-        unsigned char chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good())
+        if (p >= end)
         {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader < 128)
+        unsigned char chunkheader = *p++;
+        bool raw = chunkheader < 128;
+        unsigned long count = raw ? chunkheader + 1 : chunkheader - 127;
+        if (currentpixel + count > pixelcount)
         {
-            chunkheader++;
-            for (int i = 0; i < chunkheader; i++)
-            {
-                in.read((char *)colorbuffer.bgra, bytespp);
-                if (!in.good())
-                {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t = 0; t < bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel > pixelcount)
-                {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+            std::cerr << "Too many pixels read\n";
+            return false;
+        }
+        unsigned long chunkbytes = raw ? count * bytespp : bytespp;
+        if ((size_t)(end - p) < chunkbytes)
+        {
+            std::cerr << "an error occured while reading the header\n";
+            return false;
+        }
+        if (raw)
+        {
+            // 原始包整段拷贝
+            memcpy(dst, p, chunkbytes);
+        }
+        else if (bytespp == RGBA)
+        {
+            uint32_t pixel;
+            memcpy(&pixel, p, 4);
+            for (unsigned long i = 0; i < count; i++)
+                memcpy(dst + i * 4, &pixel, 4);
+        }
+        else if (bytespp == GRAYSCALE)
+        {
+            memset(dst, *p, count);
         }
         else
         {
-            chunkheader -= 127;
-            in.read((char *)colorbuffer.bgra, bytespp);
-            if (!in.good())
-            {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i = 0; i < chunkheader; i++)
-            {
-                for (int t = 0; t < bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel > pixelcount)
-                {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+            for (unsigned long i = 0; i < count; i++)
+                memcpy(dst + i * bytespp, p, bytespp);
         }
-    } while (currentpixel < pixelcount);
+        p += chunkbytes;
+        dst += count * bytespp;
+        currentpixel += count;
+    }
     return true;
 }
 
 bool TGAImage::write_tga_file(const char *filename, bool rle)
 {
-    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
-    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
-    unsigned char footer[18] = {'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'};
+    std::vector<unsigned char> buf;
+    if (!write_tga_memory(buf, rle))
+        return false;
+    // 整个文件在内存中编码好, 一次写出
     std::ofstream out;
     out.open(filename, std::ios::binary);
     if (!out.is_open())
     {
         std::cerr << "can't open file " << filename << "\n";
-        out.close();
         return false;
     }
-    TGA_Header header;
-    memset((void *)&header, 0, sizeof(header));
-    header.bitsperpixel = bytespp << 3;
-    header.width = width;
-    header.height = height;
-    header.datatypecode = (bytespp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
-    header.imagedescriptor = 0x20; // top-left origin
-    out.write((char *)&header, sizeof(header));
+    out.write((const char *)buf.data(), buf.size());
     if (!out.good())
     {
-        out.close();
         std::cerr << "can't dump the tga file\n";
         return false;
     }
-    if (!rle)
-    {
-        out.write((char *)data, width * height * bytespp);
-        if (!out.good())
-        {
-            std::cerr << "can't unload raw data\n";
-            out.close();
-            return false;
-        }
-    }
-    else
+    out.close();
+    return true;
+}
+
+bool TGAImage::write_tga_fd(int fd, bool rle)
+{
+#ifdef TGAIMAGE_POSIX
+    std::vector<unsigned char> buf;
+    if (!write_tga_memory(buf, rle))
+        return false;
+    for (size_t written = 0; written < buf.size();)
     {
-        if (!unload_rle_data(out))
+        ssize_t n = write(fd, buf.data() + written, buf.size() - written);
+        if (n < 0)
         {
-            out.close();
-            std::cerr << "can't unload rle data\n";
+            if (errno == EINTR)
+                continue;
+            std::cerr << "can't dump the tga file\n";
             return false;
         }
+        written += n;
     }
-    out.write((char *)developer_area_ref, sizeof(developer_area_ref));
-    if (!out.good())
+    return true;
+#else
+    std::cerr << "writing to a file descriptor is not supported\n";
+    return false;
+#endif
+}
+
+bool TGAImage::write_tga_memory(std::vector<unsigned char> &out, bool rle)
+{
+    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
+    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
+    unsigned char footer[18] = {'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'};
+    out.clear();
+    if (!data)
     {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
+        std::cerr << "can't dump an empty image\n";
         return false;
     }
-    out.write((char *)extension_area_ref, sizeof(extension_area_ref));
-    if (!out.good())
+    TGA_Header header;
+    memset((void *)&header, 0, sizeof(header));
+    header.bitsperpixel = bytespp << 3;
+    header.width = width;
+    header.height = height;
+    header.datatypecode = (bytespp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
+    header.imagedescriptor = 0x20; // top-left origin
+    out.insert(out.end(), (unsigned char *)&header, (unsigned char *)&header + sizeof(header));
+    unsigned long nbytes = (unsigned long)width * height * bytespp;
+    if (!rle)
     {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+        out.insert(out.end(), data, data + nbytes);
     }
-    out.write((char *)footer, sizeof(footer));
-    if (!out.good())
+    else
     {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+        // 按扫描线分带并行编码, 包不跨越带的边界, 带的划分与线程数无关, 输出是确定的
+        const int band_rows = 32;
+        int nbands = (height + band_rows - 1) / band_rows;
+        std::vector<std::vector<unsigned char>> bands(nbands);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int b = 0; b < nbands; b++)
+        {
+            int rows = std::min(band_rows, height - b * band_rows);
+            bands[b].reserve((size_t)rows * width * bytespp + rows * width / 128 + 16);
+            unload_rle_data(data + (size_t)b * band_rows * width * bytespp, (unsigned long)rows * width, bytespp, bands[b]);
+        }
+        size_t total = out.size();
+        for (const std::vector<unsigned char> &band : bands)
+            total += band.size();
+        out.reserve(total + sizeof(developer_area_ref) + sizeof(extension_area_ref) + sizeof(footer));
+        for (const std::vector<unsigned char> &band : bands)
+            out.insert(out.end(), band.begin(), band.end());
     }
-    out.close();
+    out.insert(out.end(), developer_area_ref, developer_area_ref + sizeof(developer_area_ref));
+    out.insert(out.end(), extension_area_ref, extension_area_ref + sizeof(extension_area_ref));
+    out.insert(out.end(), footer, footer + sizeof(footer));
     return true;
 }
 
 // TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out)
+void TGAImage::unload_rle_data(const unsigned char *pixels, unsigned long npixels, int bytespp, std::vector<unsigned char> &out)
 {
     const unsigned char max_chunk_length = 128;
-    unsigned long npixels = width * height;
     unsigned long curpix = 0;
     while (curpix < npixels)
     {
@@ -259,11 +321,7 @@ bool TGAImage::unload_rle_data(std::ofstream &out)
         bool raw = true;
         while (curpix + run_length < npixels && run_length < max_chunk_length)
         {
-            bool succ_eq = true;
-            for (int t = 0; succ_eq && t < bytespp; t++)
-            {
-                succ_eq = (data[curbyte + t] == data[curbyte + t + bytespp]);
-            }
+            bool succ_eq = memcmp(pixels + curbyte, pixels + curbyte + bytespp, bytespp) == 0;
             curbyte += bytespp;
             if (1 == run_length)
             {
@@ -281,20 +339,9 @@ bool TGAImage::unload_rle_data(std::ofstream &out)
             run_length++;
         }
         curpix += run_length;
-        out.put(raw ? run_length - 1 : run_length + 127);
-        if (!out.good())
-        {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write((char *)(data + chunkstart), (raw ? run_length * bytespp : bytespp));
-        if (!out.good())
-        {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
+        out.push_back(raw ? run_length - 1 : run_length + 127);
+        out.insert(out.end(), pixels + chunkstart, pixels + chunkstart + (raw ? run_length * bytespp : bytespp));
     }
-    return true;
 }
 
 TGAColor TGAImage::get(int x, int y)
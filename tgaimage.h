@@ -1,7 +1,9 @@
 #ifndef __IMAGE_H__
 #define __IMAGE_H__
 
+#include <cstddef>
 #include <fstream>
+#include <vector>
 
 #pragma pack(push, 1)
 struct TGA_Header
@@ -86,8 +88,8 @@ protected:
     int height;
     int bytespp;
 
-    bool load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    // 从内存中解码 RLE 数据, p 前进到数据之后
+    bool load_rle_data(const unsigned char *&p, const unsigned char *end);
 
 public:
     enum Format
@@ -97,11 +99,21 @@ public:
         RGBA = 4
     };
 
+    // 把从 pixels 开始的 npixels 个像素编码成 RLE 包, 追加到 out
+    static void unload_rle_data(const unsigned char *pixels, unsigned long npixels, int bytespp, std::vector<unsigned char> &out);
+
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
     bool read_tga_file(const char *filename);
+    // 从内存中的完整 TGA 文件读取
+    bool read_tga_memory(const unsigned char *buf, size_t size);
+    // 从文件描述符读到结束(可以是管道或套接字)
+    bool read_tga_fd(int fd);
     bool write_tga_file(const char *filename, bool rle = true);
+    // 把完整的 TGA 文件编码到 out(覆盖原有内容)
+    bool write_tga_memory(std::vector<unsigned char> &out, bool rle = true);
+    bool write_tga_fd(int fd, bool rle = true);
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
@@ -0,0 +1,44 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "meshcache.h"
+#include "meshopt.h"
+
+static void printStats(const char *label, const MeshStats &s)
+{
+    std::cerr << "  " << label << ": ACMR " << s.acmr << " ATVR " << s.atvr << " overdraw " << s.overdraw << std::endl;
+}
+
+// 三角化并重排网格, 输出优化过的 .mesh 缓存: meshopt a.obj [b.obj ...]
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " model.obj [model.obj ...]" << std::endl;
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string path = argv[i];
+        std::string base = path.size() > 4 && path.compare(path.size() - 4, 4, ".obj") == 0 ? path.substr(0, path.size() - 4) : path;
+        SourceStamp stamp;
+        MeshBuffers buffers;
+        if (!sourceStamp(base + ".obj", stamp) || !buildMesh(base + ".obj", buffers))
+        {
+            std::cerr << "can't load " << base << ".obj" << std::endl;
+            failed++;
+            continue;
+        }
+        std::cerr << base << ": " << buffers.vertices.size() << " vertices, " << buffers.indices.size() / 3 << " triangles" << std::endl;
+        printStats("before", analyzeMesh(buffers.view()));
+        auto start = std::chrono::steady_clock::now();
+        optimizeMesh(buffers);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        printStats("after ", analyzeMesh(buffers.view()));
+        std::cerr << "  optimized in " << elapsed.count() << " ms" << std::endl;
+        if (!writeMeshCache(base + ".mesh", buffers.view(), stamp))
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
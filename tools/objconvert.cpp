@@ -0,0 +1,38 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "meshcache.h"
+
+// 把 OBJ 转换成二进制网格缓存: objconvert a.obj [b.obj ...], 输出为同名的 .mesh 文件
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " model.obj [model.obj ...]" << std::endl;
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string path = argv[i];
+        std::string base = path.size() > 4 && path.compare(path.size() - 4, 4, ".obj") == 0 ? path.substr(0, path.size() - 4) : path;
+        auto start = std::chrono::steady_clock::now();
+        SourceStamp stamp;
+        MeshBuffers buffers;
+        if (!sourceStamp(base + ".obj", stamp) || !buildMesh(base + ".obj", buffers))
+        {
+            std::cerr << "can't load " << base << ".obj" << std::endl;
+            failed++;
+            continue;
+        }
+        MeshView mesh = buffers.view();
+        if (!writeMeshCache(base + ".mesh", mesh, stamp))
+        {
+            failed++;
+            continue;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << base << ".mesh: " << mesh.nverts << " vertices, " << mesh.nfaces << " faces, " << elapsed.count() << " ms" << std::endl;
+    }
+    return failed ? 1 : 0;
+}
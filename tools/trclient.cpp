@@ -0,0 +1,55 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// 渲染服务的客户端: trclient socket < requests.jsonl
+// 把标准输入的每一行发给服务, 回复按完成顺序打印到标准输出
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: " << argv[0] << " socket < requests.jsonl" << std::endl;
+        return 1;
+    }
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::string path = argv[1];
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "socket path too long: " << path << std::endl;
+        return 1;
+    }
+    path.copy(addr.sun_path, path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "can't connect to " << path << std::endl;
+        return 1;
+    }
+    // 发送和接收分开, 服务的队列满时也能继续收回复
+    std::thread sender([fd] {
+        std::string line;
+        while (std::getline(std::cin, line))
+        {
+            line += '\n';
+            for (size_t sent = 0; sent < line.size();)
+            {
+                ssize_t n = send(fd, line.data() + sent, line.size() - sent, 0);
+                if (n <= 0)
+                    return;
+                sent += n;
+            }
+        }
+        shutdown(fd, SHUT_WR);
+    });
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        std::cout.write(buf, n).flush();
+    sender.join();
+    close(fd);
+    return 0;
+}